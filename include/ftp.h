@@ -1,5 +1,19 @@
 #pragma once
 
+/*! ftp server settings */
+typedef struct ftp_config_t
+{
+  unsigned int workers; /*!< number of threads serving sessions (0 for one per core) */
+  unsigned int quantum; /*!< bytes a transfer may move per loop round (0 for no limit) */
+  unsigned int list_cache; /*!< bytes of directory listings to cache (0 to disable) */
+  unsigned int list_ttl;   /*!< seconds a cached listing stays fresh (0 for forever) */
+  unsigned int stat_threads; /*!< threads per worker fetching attributes for listings */
+  unsigned int metrics_port; /*!< port serving the metrics page (0 to disable) */
+} ftp_config_t;
+
+/*! ftp server settings; adjust before calling ftp_init() */
+extern ftp_config_t ftp_config;
+
 int  ftp_init(void);
 int  ftp_loop(void);
 void ftp_exit(void);
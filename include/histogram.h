@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS 4 /* sub-buckets per power of two, as bits (~6% error) */
+#define HISTOGRAM_BUCKETS  ((32 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+/*! log-linear histogram in the style of HdrHistogram
+ *
+ *  Values below 2^HISTOGRAM_SUB_BITS get a bucket each; every power of two
+ *  above that is split into 2^HISTOGRAM_SUB_BITS buckets. Values from 2^32
+ *  on are counted in the last bucket.
+ *
+ *  Only one thread records into a histogram, so recording needs no lock;
+ *  any thread may read it with histogram_add.
+ */
+typedef struct histogram_t
+{
+  uint32_t count[HISTOGRAM_BUCKETS]; /*!< samples per bucket */
+  uint64_t max;                      /*!< largest sample */
+} histogram_t;
+
+void histogram_record(histogram_t *hist, uint64_t value);
+void histogram_add(histogram_t *sum, const histogram_t *hist);
+
+uint64_t histogram_count(const histogram_t *hist);
+uint64_t histogram_percentile(const histogram_t *hist, unsigned int percent);
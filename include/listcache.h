@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "thread.h"
+
+typedef struct listcache_entry_t listcache_entry_t;
+
+/*! rendered directory listing */
+struct listcache_entry_t
+{
+  listcache_entry_t *prev;    /*!< more recently used entry */
+  listcache_entry_t *next;    /*!< less recently used entry */
+  const char        *path;    /*!< directory that was listed */
+  unsigned int      format;   /*!< how the listing was rendered */
+  char              *data;    /*!< rendered listing (NULL if empty) */
+  size_t            size;     /*!< bytes in data */
+  uint64_t          entries;  /*!< directory entries in the listing */
+  size_t            cost;     /*!< bytes charged against the cache capacity */
+  uint64_t          expires;  /*!< when the listing goes stale (usec, 0 for never) */
+  unsigned int      refs;     /*!< sessions sending it, plus one while cached */
+};
+
+/*! size-bounded LRU cache of directory listings shared by all workers */
+typedef struct listcache_t
+{
+  mutex_t           lock;        /*!< protects everything below */
+  listcache_entry_t *head;       /*!< most recently used entry */
+  listcache_entry_t *tail;       /*!< least recently used entry */
+  size_t            size;        /*!< bytes charged by cached entries */
+  size_t            capacity;    /*!< most bytes to charge (0 disables the cache) */
+  uint64_t          ttl;         /*!< how long a listing stays fresh (usec, 0 for forever) */
+  unsigned int      generation;  /*!< bumped by every invalidation */
+  int               initialized; /*!< lock was created */
+} listcache_t;
+
+int  listcache_init(listcache_t *cache, size_t capacity, uint64_t ttl);
+void listcache_exit(listcache_t *cache);
+
+listcache_entry_t* listcache_get(listcache_t *cache, const char *path, unsigned int format,
+                                 uint64_t now);
+void listcache_put(listcache_t *cache, listcache_entry_t *entry);
+
+unsigned int listcache_generation(listcache_t *cache);
+void listcache_insert(listcache_t *cache, const char *path, unsigned int format,
+                      char *data, size_t size, uint64_t entries, unsigned int generation,
+                      uint64_t now);
+void listcache_invalidate(listcache_t *cache, const char *path, size_t len, int subtree);
@@ -0,0 +1,35 @@
+#pragma once
+
+#ifdef _3DS
+#include <3ds.h>
+
+typedef Handle mutex_t;
+typedef Handle event_t;
+typedef Thread thread_t;
+#else
+#include <pthread.h>
+
+typedef pthread_mutex_t mutex_t;
+typedef pthread_t       thread_t;
+
+/*! auto-reset event */
+typedef struct
+{
+  pthread_mutex_t mutex;     /*!< protects signalled */
+  pthread_cond_t  cond;      /*!< waiters */
+  int             signalled; /*!< event is set */
+} event_t;
+#endif
+
+int  mutex_init(mutex_t *mutex);
+void mutex_destroy(mutex_t *mutex);
+void mutex_lock(mutex_t *mutex);
+void mutex_unlock(mutex_t *mutex);
+
+int  event_init(event_t *event);
+void event_destroy(event_t *event);
+void event_signal(event_t *event);
+void event_wait(event_t *event);
+
+int  thread_create(thread_t *thread, void (*entry)(void*), void *arg, int core);
+void thread_join(thread_t thread);
@@ -0,0 +1,42 @@
+#pragma once
+
+#ifdef FTP_USE_IO_URING
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*! io_uring instance */
+typedef struct uring_t
+{
+  int                 fd;           /*!< ring file descriptor (-1 if none) */
+  unsigned int        *sq_head;     /*!< submission queue head (kernel) */
+  unsigned int        *sq_tail;     /*!< submission queue tail (user) */
+  unsigned int        *sq_mask;     /*!< submission queue index mask */
+  unsigned int        *sq_array;    /*!< submission queue index array */
+  struct io_uring_sqe *sqes;        /*!< submission queue entries */
+  unsigned int        sqe_tail;     /*!< next free submission queue entry */
+  unsigned int        to_submit;    /*!< entries filled but not submitted */
+  unsigned int        *cq_head;     /*!< completion queue head (user) */
+  unsigned int        *cq_tail;     /*!< completion queue tail (kernel) */
+  unsigned int        *cq_mask;     /*!< completion queue index mask */
+  struct io_uring_cqe *cqes;        /*!< completion queue entries */
+  void                *sq_ring;     /*!< submission queue mapping */
+  size_t              sq_ring_size; /*!< size of sq_ring */
+  void                *cq_ring;     /*!< completion queue mapping */
+  size_t              cq_ring_size; /*!< size of cq_ring */
+  size_t              sqes_size;    /*!< size of sqes mapping */
+  unsigned int        sq_entries;   /*!< submission queue capacity */
+} uring_t;
+
+int  uring_init(uring_t *ring, unsigned int entries);
+void uring_exit(uring_t *ring);
+
+int  uring_register_buffers(uring_t *ring, const struct iovec *iov, unsigned int count);
+int  uring_register_eventfd(uring_t *ring, int fd);
+
+struct io_uring_sqe* uring_get_sqe(uring_t *ring);
+int  uring_submit(uring_t *ring, unsigned int wait);
+
+struct io_uring_cqe* uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+#endif
@@ -10,9 +10,12 @@
 
 #ifdef _3DS
 #include "banner_bin.h"
+#include "thread.h"
 
 static PrintConsole status_console;
 static PrintConsole main_console;
+/*! serializes output from the session workers */
+static mutex_t      console_lock;
 
 /*! initialize console subsystem */
 void
@@ -27,6 +30,8 @@ console_init(void)
   consoleSelect(&main_console);
 
   consoleDebugInit(debugDevice_NULL);
+
+  mutex_init(&console_lock);
 }
 
 /*! set status bar contents
@@ -39,12 +44,14 @@ console_set_status(const char *fmt, ...)
 {
   va_list ap;
 
+  mutex_lock(&console_lock);
   consoleSelect(&status_console);
   va_start(ap, fmt);
   vprintf(fmt, ap);
   vfprintf(stderr, fmt, ap);
   va_end(ap);
   consoleSelect(&main_console);
+  mutex_unlock(&console_lock);
 }
 
 /*! add text to the console
@@ -57,10 +64,12 @@ console_print(const char *fmt, ...)
 {
   va_list ap;
 
+  mutex_lock(&console_lock);
   va_start(ap, fmt);
   vprintf(fmt, ap);
   vfprintf(stderr, fmt, ap);
   va_end(ap);
+  mutex_unlock(&console_lock);
 }
 
 /*! draw console to screen */
@@ -70,10 +79,9 @@ console_render(void)
   /* clear all screens */
   gfxDrawSprite(GFX_BOTTOM, GFX_LEFT, (u8*)banner_bin, 240, 320, 0, 0);
 
-  /* flush framebuffer */
+  /* flush framebuffer and swap at the next vblank without waiting for it */
   gfxFlushBuffers();
-  gspWaitForVBlank();
-  gfxSwapBuffers();
+  gfxSwapBuffersGpu();
 }
 #else
 
@@ -7,28 +7,77 @@
 #include <malloc.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #ifdef _3DS
 #include <3ds.h>
 #define lstat stat
+#else
+#include <netinet/tcp.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#define FTP_USE_EPOLL    1
+#define FTP_USE_EVENTFD  1
+#define FTP_USE_SENDFILE 1
+#define FTP_USE_SPLICE   1
 #endif
 #include "console.h"
+#include "histogram.h"
+#include "listcache.h"
+#include "thread.h"
+#include "uring.h"
 
 #define POLL_UNKNOWN    (~(POLLIN|POLLOUT))
 
-#define XFER_BUFFERSIZE 32768
+#ifndef XFER_BUFFERSIZE
+#ifdef _3DS
+#define XFER_BUFFERSIZE 0x8000  /* file I/O chunk; matches the socket buffers */
+#else
+#define XFER_BUFFERSIZE 0x20000 /* file I/O chunk; fewer syscalls per MB */
+#endif
+#endif
+#define XFER_ALIGN      0x1000
 #define SOCK_BUFFERSIZE 32768
-#define FILE_BUFFERSIZE 65536
 #define CMD_BUFFERSIZE  1024
+#define OUT_BUFFERSIZE  4096 /* queued reply bytes before a session stops reading commands */
+#define SENDFILE_CHUNK  0x7FFFF000 /* most sendfile() will transfer at once */
+#define PIPE_BUFFERSIZE 0x100000   /* splice() pipe capacity to ask for */
+#define SESSION_SLAB    16 /* sessions allocated at once */
+#define POOL_KEEP       4  /* free buffers a worker keeps around */
+#define STAGE_BUFFERS   4  /* buffers a transfer keeps in flight with the disk thread */
+#define PREFETCH_ENTRIES 128 /* directory entries a listing reads ahead for the stat threads */
+#define MAX_STAT_THREADS 16  /* stat threads per worker */
+#define CMD_SLOTS_BITS  6 /* the command table has 1 << CMD_SLOTS_BITS slots */
+#define CMD_SLOTS       (1 << CMD_SLOTS_BITS)
+#define LATENCY_DATA_SETUP CMD_SLOTS       /* histogram of PASV accept or PORT connect times */
+#define LATENCY_FIRST_BYTE (CMD_SLOTS + 1) /* histogram of times to the first data byte */
+#define NUM_LATENCIES      (CMD_SLOTS + 2) /* one per command slot, plus the above */
+#define URING_ENTRIES    256     /* io_uring submission queue entries per worker */
+#define URING_BUFFERS    64      /* io_uring transfer buffers per worker */
+#define URING_BUFFERSIZE 0x10000 /* size of each io_uring transfer buffer */
 #define SOCU_ALIGN      0x1000
 #define SOCU_BUFFERSIZE 0x100000
 #define LISTEN_PORT     5000
+#define MAX_EVENTS      64
+#define MAX_WORKERS     16
+#define MAX_SCRAPES     4    /* metrics requests served at once */
+#define SCRAPE_BUFFERSIZE 1024 /* longest metrics request header */
+#ifdef _3DS
+#define LOOP_TIMEOUT    4  /* short enough to keep the main loop responsive */
+#else
+#define LOOP_TIMEOUT    -1 /* block until a socket is ready */
+#endif
+#define WAKE_TIMEOUT    4  /* how often to check for handoffs without wake_fd */
 #ifdef _3DS
 #define DATA_PORT       (LISTEN_PORT+1)
 #else
@@ -36,6 +85,9 @@
 #endif
 
 typedef struct ftp_session_t ftp_session_t;
+typedef struct ftp_worker_t  ftp_worker_t;
+typedef struct ftp_stage_t   ftp_stage_t;
+typedef struct ftp_prefetch_t ftp_prefetch_t;
 
 #define FTP_DECLARE(x) static int x(ftp_session_t *session, const char *args)
 FTP_DECLARE(ALLO);
@@ -46,6 +98,8 @@ FTP_DECLARE(DELE);
 FTP_DECLARE(FEAT);
 FTP_DECLARE(LIST);
 FTP_DECLARE(MKD);
+FTP_DECLARE(MLSD);
+FTP_DECLARE(MLST);
 FTP_DECLARE(MODE);
 FTP_DECLARE(NLST);
 FTP_DECLARE(NOOP);
@@ -60,6 +114,8 @@ FTP_DECLARE(RETR);
 FTP_DECLARE(RMD);
 FTP_DECLARE(RNFR);
 FTP_DECLARE(RNTO);
+FTP_DECLARE(SITE);
+FTP_DECLARE(STAT);
 FTP_DECLARE(STOR);
 FTP_DECLARE(STOU);
 FTP_DECLARE(STRU);
@@ -74,6 +130,163 @@ typedef enum
   DATA_CONNECT_STATE,  /*!< waiting for connection after PASV command */
   DATA_TRANSFER_STATE, /*!< data transfer in progress */
 } session_state_t;
+/*! number of session states */
+#define NUM_SESSION_STATES (DATA_TRANSFER_STATE + 1)
+
+/*! directory listing format */
+typedef enum
+{
+  LIST_FORMAT, /*!< LIST: ls -l style lines */
+  MLSD_FORMAT, /*!< MLSD: RFC 3659 facts and name */
+  NLST_FORMAT, /*!< NLST: name only */
+} list_format_t;
+
+/*! RFC 3659 facts, in the order they are sent */
+static const char *ftp_facts[] = { "type", "size", "modify", "perm", };
+#define FACT_TYPE   (1 << 0)
+#define FACT_SIZE   (1 << 1)
+#define FACT_MODIFY (1 << 2)
+#define FACT_PERM   (1 << 3)
+#define FACT_ALL    (FACT_TYPE|FACT_SIZE|FACT_MODIFY|FACT_PERM)
+/*! longest rendering of all facts */
+#define FACTS_MAX   96
+
+/*! session socket watched by the event engine */
+typedef enum
+{
+  WATCH_CMD,   /*!< command socket */
+  WATCH_PASV,  /*!< PASV listen socket */
+  WATCH_DATA,  /*!< data socket */
+  NUM_WATCHES,
+} watch_kind_t;
+
+#ifdef FTP_USE_IO_URING
+/*! io_uring request tag, stored in the low bits of user_data */
+typedef enum
+{
+  URING_FILE = 1, /*!< request on the file */
+  URING_DATA = 2, /*!< request on the data socket */
+  URING_MASK = 3,
+} uring_op_t;
+#endif
+
+/*! event engine registration of a socket */
+typedef struct ftp_watch_t
+{
+  ftp_session_t *session; /*!< owning session (NULL for listen socket) */
+  watch_kind_t  kind;     /*!< which session socket this is */
+  int           fd;       /*!< registered socket (-1 if unregistered) */
+  int           events;   /*!< registered events */
+  int           slot;     /*!< index in poll set (-1 if none) */
+} ftp_watch_t;
+
+/*! ready socket returned by the event engine */
+typedef struct ftp_event_t
+{
+  ftp_watch_t *watch;   /*!< registration */
+  int         fd;       /*!< socket which was ready */
+  int         revents;  /*!< returned poll events */
+} ftp_event_t;
+
+/*! allocator for fixed-size blocks */
+typedef struct ftp_pool_t
+{
+  size_t size;     /*!< block size */
+  size_t per_slab; /*!< blocks carved from each allocation */
+  size_t max_free; /*!< free blocks to keep when per_slab is 1 */
+  size_t num_free; /*!< number of free blocks */
+  void   *free;    /*!< free blocks, linked through their first word */
+  void   *slabs;   /*!< allocations, linked through their first word */
+} ftp_pool_t;
+
+/*! ring of transfer buffers shared between a session and its worker's disk thread
+ *
+ *  @note for RETR the disk thread fills buffers and the event loop drains
+ *        them, for STOR it is the other way around; head is only written
+ *        by the side filling buffers and tail only by the side draining them
+ */
+struct ftp_stage_t
+{
+  ftp_session_t *session;   /*!< session being served (NULL once abandoned) */
+  ftp_stage_t   *next;      /*!< link in the disk queue */
+  ftp_stage_t   *done_next; /*!< link in the done list */
+  char          *buffer[STAGE_BUFFERS]; /*!< XFER_BUFFERSIZE buffers */
+  size_t        length[STAGE_BUFFERS];  /*!< bytes in each filled buffer */
+  unsigned int  head;       /*!< buffers filled */
+  unsigned int  tail;       /*!< buffers drained */
+  size_t        pos;        /*!< bytes of the event loop's partial buffer */
+  int           fd;         /*!< file being transferred (-1 if none) */
+  int           store;      /*!< the disk thread writes the file instead of reading it */
+  int           eof;        /*!< the side filling buffers is done */
+  int           error;      /*!< errno of a failed disk operation (0 if none) */
+  int           cancel;     /*!< the disk thread should stop */
+  int           queued;     /*!< on the disk queue or being served (worker lock) */
+  int           done;       /*!< on the done list (worker lock) */
+  uint64_t      syscalls;   /*!< syscalls made by the disk thread */
+  uint64_t      copied;     /*!< bytes the disk thread copied through user space */
+};
+
+/*! directory entry whose attributes are fetched by a stat thread */
+typedef struct ftp_prefetch_entry_t
+{
+  struct stat st;    /*!< attributes */
+  int         need;  /*!< st has to be fetched */
+  int         ready; /*!< st is filled in or error is set */
+  int         error; /*!< errno of the failed stat (0 if none) */
+  char        name[sizeof(((struct dirent*)0)->d_name)]; /*!< entry name */
+} ftp_prefetch_entry_t;
+
+/*! directory entries read ahead of a listing so the worker's stat threads
+ *  can fetch their attributes concurrently
+ *
+ *  @note only the event loop writes head and tail; an entry between them
+ *        belongs to the stat threads until it is ready
+ */
+struct ftp_prefetch_t
+{
+  ftp_session_t  *session;   /*!< listing session (NULL once abandoned) */
+  ftp_prefetch_t *next;      /*!< link in the stat queue */
+  ftp_prefetch_t *done_next; /*!< link in the done list */
+  int            dir_fd;     /*!< duplicate of the directory's fd (-1 if none) */
+  char           *path;      /*!< directory being listed */
+  int            full;       /*!< directories need more than their type */
+  unsigned int   head;       /*!< entries rendered */
+  unsigned int   tail;       /*!< entries read from the directory (worker lock) */
+  unsigned int   claim;      /*!< next entry for a stat thread (worker lock) */
+  unsigned int   busy;       /*!< entries being fetched (worker lock) */
+  int            queued;     /*!< on the stat queue (worker lock) */
+  int            done;       /*!< on the done list (worker lock) */
+  int            waiting;    /*!< the event loop waits for entry head (worker lock) */
+  uint64_t       stats;      /*!< stat calls made */
+  ftp_prefetch_entry_t entry[PREFETCH_ENTRIES]; /*!< entries, indexed modulo PREFETCH_ENTRIES */
+};
+
+/*! worker counters for the metrics page
+ *
+ *  @note only the worker writes them, so no lock or atomic read-modify-write
+ *        is needed; the metrics page reads them with atomic loads
+ */
+typedef struct ftp_metrics_t
+{
+  uint64_t sessions[NUM_SESSION_STATES]; /*!< sessions in each state */
+  uint64_t bytes_sent;      /*!< bytes sent on data connections */
+  uint64_t bytes_received;  /*!< bytes received on data connections */
+  uint64_t xfer_started;    /*!< transfer commands which asked for a data connection */
+  uint64_t xfer_completed;  /*!< transfers which ended with 226 */
+  uint64_t xfer_aborted;    /*!< transfers which ended with 426 */
+  uint64_t xfer_errors;     /*!< transfers which ended with 451 */
+  uint64_t xfer_failed;     /*!< transfers which ended any other way */
+  uint64_t list_entries;    /*!< directory entries sent in listings */
+  uint64_t loop_iterations; /*!< rounds of the event loop */
+} ftp_metrics_t;
+
+/*! metrics request being read */
+typedef struct ftp_scrape_t
+{
+  ftp_watch_t watch;                      /*!< event engine registration (fd -1 if unused) */
+  char        request[SCRAPE_BUFFERSIZE]; /*!< request received so far */
+  size_t      size;                       /*!< bytes in request */
+} ftp_scrape_t;
 
 /*! ftp session */
 struct ftp_session_t
@@ -84,6 +297,17 @@ struct ftp_session_t
   int                cmd_fd;    /*!< socket for command connection */
   int                pasv_fd;   /*!< listen socket for PASV */
   int                data_fd;   /*!< socket for data transfer */
+#ifdef FTP_USE_SPLICE
+  int                pipe_fd[2]; /*!< pipe for splice() from data_fd */
+  size_t             pipe_size;  /*!< capacity of pipe */
+#endif
+#ifdef FTP_USE_IO_URING
+  int                io_buffer;  /*!< io_uring transfer buffer (-1 if none) */
+  int                io_pending; /*!< io_uring requests in flight */
+  int                io_reply;   /*!< reply code for a failed request (0 if none) */
+  int                io_cancel;  /*!< in-flight requests were cancelled */
+#endif
+  ftp_stage_t        *stage;     /*!< buffers shared with the disk thread (NULL if none) */
 /*! data transfers in binary mode */
 #define SESSION_BINARY (1 << 0)
 /*! have pasv_addr ready for data transfer command */
@@ -96,91 +320,234 @@ struct ftp_session_t
 #define SESSION_SEND   (1 << 4)
 /*! last command was RNFR and buffer contains path */
 #define SESSION_RENAME (1 << 5)
+/*! directory listing is being copied into capture for the cache */
+#define SESSION_CAPTURE (1 << 6)
+/*! rest of an overlong command line is being thrown away */
+#define SESSION_SKIP    (1 << 7)
+/*! a transfer was counted as started and its final reply is still due */
+#define SESSION_XFER    (1 << 8)
   int                flags;     /*!< session flags */
+  int                mlst_facts; /*!< facts selected for MLSD and MLST */
   session_state_t    state;     /*!< session state */
   ftp_session_t      *next;     /*!< link to next session */
   ftp_session_t      *prev;     /*!< link to prev session */
+  ftp_worker_t       *worker;   /*!< worker serving this session */
+  ftp_watch_t        watch[NUM_WATCHES]; /*!< event engine registrations */
+  ftp_session_t      *run_next;  /*!< link to next session waiting for a round */
+  int                runnable;   /*!< waiting for a round in the worker's run queue */
+  ssize_t            deficit;    /*!< bytes the transfer may still move this round */
+  uint64_t           xfer_start; /*!< when the data transfer started (usec) */
+  uint64_t           data_start; /*!< when the transfer command asked for a data connection (usec) */
+  uint64_t           xfer_bytes; /*!< bytes moved by the data transfer */
+  uint64_t           cmd_time;   /*!< when the command being handled arrived (usec) */
+  char               cmd_buffer[CMD_BUFFERSIZE]; /*!< received command lines not handled yet */
+  size_t             cmd_size;   /*!< bytes in cmd_buffer */
+  char               *out_buffer; /*!< replies not sent yet (NULL until the first one) */
+  size_t             out_pos;    /*!< bytes of out_buffer already sent */
+  size_t             out_size;   /*!< bytes in out_buffer */
+  size_t             out_max;    /*!< capacity of out_buffer */
+  ftp_session_t      *flush_next; /*!< link to next session with replies queued this round */
+  int                flush_queued; /*!< on the worker's flush list */
+  uint64_t           reply_time; /*!< total command reply latency (usec) */
+  uint64_t           reply_max;  /*!< worst command reply latency (usec) */
+  unsigned int       num_replies; /*!< number of commands replied to */
 
   int      (*transfer)(ftp_session_t*);  /*! data transfer callback */
-  char     buffer[XFER_BUFFERSIZE];      /*! persistent data between callbacks */
-  char     tmp_buffer[XFER_BUFFERSIZE];  /*! persistent data between callbacks */
-  char     file_buffer[FILE_BUFFERSIZE]; /*! stdio file buffer */
+  char     *buffer;                      /*! persistent data between callbacks (NULL while idle) */
   size_t   bufferpos;                    /*! persistent buffer position between callbacks */
   size_t   buffersize;                   /*! persistent buffer size between callbacks */
   uint64_t filepos;                      /*! persistent file position between callbacks */
   uint64_t filesize;                     /*! persistent file size between callbacks */
-  union
-  {
-    DIR    *dp;                          /*! persistent open directory pointer between callbacks */
-    FILE   *fp;                          /*! persistent open file pointer between callbacks */
-  };
+  uint64_t restart;                      /*! offset from REST for the next RETR or STOR */
+  uint64_t xfer_syscalls;                /*! syscalls made by the data transfer */
+  uint64_t xfer_copied;                  /*! bytes the data transfer copied through user space */
+  DIR      *dp;                          /*! persistent open directory pointer between callbacks */
+  char     *list_path;                   /*! directory being listed (NULL if none) */
+  list_format_t list_format;             /*! how the listing is rendered */
+  int      list_facts;                   /*! facts rendered by MLSD */
+  uint64_t list_entries;                 /*! entries listed from dp */
+  uint64_t list_stats;                   /*! stat calls made for them */
+  ftp_prefetch_t *prefetch;              /*! entries read ahead for the stat threads (NULL if none) */
+  listcache_entry_t *listing;            /*! cached listing being sent (NULL if none) */
+  char     *capture;                     /*! listing rendered so far, for the cache */
+  size_t   capture_size;                 /*! bytes in capture */
+  size_t   capture_max;                  /*! capacity of capture */
+  unsigned int capture_gen;              /*! cache generation from before the directory was opened */
+  char     *store_path;                  /*! file being uploaded, for cache invalidation (NULL if none) */
+  int      file_fd;                      /*! persistent open file descriptor between callbacks */
+};
+
+/*! thread serving a subset of the ftp sessions */
+struct ftp_worker_t
+{
+  ftp_session_t *sessions;      /*!< list of ftp sessions */
+  unsigned int  num_sessions;   /*!< number of sessions (read by acceptor) */
+  int           reap_sessions;  /*!< a session needs to be destroyed */
+  ftp_session_t *run_head;      /*!< transfers which used up their quantum */
+  ftp_session_t *run_tail;      /*!< last session in the run queue */
+  ftp_session_t *flush_head;    /*!< sessions with replies queued this round */
+  histogram_t   latency[NUM_LATENCIES]; /*!< handler, data connection setup and first byte times (usec) */
+  ftp_metrics_t metrics;        /*!< counters for the metrics page */
+  ftp_pool_t    session_pool;   /*!< ftp_session_t allocator */
+  ftp_pool_t    xfer_pool;      /*!< page-aligned XFER_BUFFERSIZE buffer allocator */
+  ftp_pool_t    stage_pool;     /*!< ftp_stage_t allocator */
+  uint64_t      wake_time;      /*!< when the event engine last returned (usec) */
+#ifdef FTP_USE_EPOLL
+  int           epollfd;        /*!< epoll file descriptor */
+  ftp_event_t   ready_events[MAX_EVENTS]; /*!< ready sockets */
+#else
+  struct pollfd *pollfds;       /*!< poll set shared by all sessions */
+  ftp_watch_t   **pollwatches;  /*!< registration for each poll set entry */
+  ftp_event_t   *ready_events;  /*!< ready sockets (poll set capacity) */
+  nfds_t        num_pollfds;    /*!< number of entries in the poll set */
+  nfds_t        max_pollfds;    /*!< capacity of the poll set */
+#endif
+  int           wake_fd;        /*!< eventfd to wake the worker (-1 if none) */
+  ftp_watch_t   wake_watch;     /*!< event engine registration for wake_fd */
+#ifdef FTP_USE_IO_URING
+  uring_t       ring;           /*!< io_uring for data transfers (fd -1 if none) */
+  int           ring_event_fd;  /*!< eventfd signalled on ring completions */
+  ftp_watch_t   ring_watch;     /*!< event engine registration for ring_event_fd */
+  char          *ring_buffers;  /*!< URING_BUFFERS transfer buffers */
+  int           ring_fixed;     /*!< ring_buffers are registered with the ring */
+  int           free_buffers[URING_BUFFERS]; /*!< unused ring_buffers */
+  int           num_free_buffers; /*!< number of entries in free_buffers */
+#endif
+  mutex_t       lock;           /*!< protects pending, the disk and stat queues and the done lists */
+  int           *pending;       /*!< connections handed off by the acceptor */
+  size_t        num_pending;    /*!< number of pending connections */
+  size_t        max_pending;    /*!< capacity of pending */
+  thread_t      thread;         /*!< thread running this worker */
+  int           running;        /*!< thread was started */
+  int           quit;           /*!< thread should exit */
+  ftp_stage_t   *disk_head;     /*!< stages waiting for the disk thread */
+  ftp_stage_t   *disk_tail;     /*!< last stage in the disk queue */
+  ftp_stage_t   *disk_done;     /*!< stages the disk thread made progress on */
+  event_t       disk_event;     /*!< wakes the disk thread */
+  thread_t      disk_thread;    /*!< thread doing file I/O for staged transfers */
+  int           disk_running;   /*!< disk thread was started */
+  int           disk_quit;      /*!< disk thread should exit (worker lock) */
+  ftp_prefetch_t *stat_head;    /*!< listings with entries for the stat threads */
+  ftp_prefetch_t *stat_tail;    /*!< last listing in the stat queue */
+  ftp_prefetch_t *stat_done;    /*!< listings which were waiting and can go on */
+  event_t       stat_event;     /*!< wakes the stat threads */
+  thread_t      stat_threads[MAX_STAT_THREADS]; /*!< threads fetching attributes for listings */
+  unsigned int  num_stat_threads; /*!< number of stat threads started */
+  int           stat_quit;      /*!< stat threads should exit (worker lock) */
 };
 
+/*! ftp command flags */
+#define CMD_RENAME  (1 << 0) /*!< keeps the path saved by RNFR (RNTO) */
+#define CMD_RESTART (1 << 1) /*!< uses up the REST offset */
+
 /*! ftp command descriptor */
 typedef struct ftp_command
 {
   const char *name;                                   /*!< command name */
   int        (*handler)(ftp_session_t*, const char*); /*!< command callback */
+  uint32_t   key;                                     /*!< packed command name */
+  int        flags;                                   /*!< CMD_* flags */
 } ftp_command_t;
 
-static ftp_command_t ftp_commands[] =
-{
-#define FTP_COMMAND(x) { #x, x, }
-#define FTP_ALIAS(x,y) { #x, y, }
-  FTP_COMMAND(ALLO),
-  FTP_COMMAND(APPE),
-  FTP_COMMAND(CDUP),
-  FTP_COMMAND(CWD),
-  FTP_COMMAND(DELE),
-  FTP_COMMAND(FEAT),
-  FTP_COMMAND(LIST),
-  FTP_COMMAND(MKD),
-  FTP_COMMAND(MODE),
-  FTP_COMMAND(NLST),
-  FTP_COMMAND(NOOP),
-  FTP_COMMAND(OPTS),
-  FTP_COMMAND(PASS),
-  FTP_COMMAND(PASV),
-  FTP_COMMAND(PORT),
-  FTP_COMMAND(PWD),
-  FTP_COMMAND(QUIT),
-  FTP_COMMAND(REST),
-  FTP_COMMAND(RETR),
-  FTP_COMMAND(RMD),
-  FTP_COMMAND(RNFR),
-  FTP_COMMAND(RNTO),
-  FTP_COMMAND(STOR),
-  FTP_COMMAND(STOU),
-  FTP_COMMAND(STRU),
-  FTP_COMMAND(SYST),
-  FTP_COMMAND(TYPE),
-  FTP_COMMAND(USER),
-  FTP_ALIAS(XCUP, CDUP),
-  FTP_ALIAS(XMKD, MKD),
-  FTP_ALIAS(XPWD, PWD),
-  FTP_ALIAS(XRMD, RMD),
+/*! pack a 3 or 4 letter command name into a lookup key */
+#define CMD_KEY(a,b,c,d) ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 \
+                        | (uint32_t)(c) << 8  | (uint32_t)(d))
+
+/*! map a lookup key to its ftp_commands slot
+ *
+ *  The multiplier was searched for so that no two commands share a slot. A
+ *  new command may need a new multiplier; FTP_COMMANDS_CHECK catches that.
+ */
+#define CMD_SLOT(key) ((uint32_t)((key) * 0x4F3BC48Bu) >> (32 - CMD_SLOTS_BITS))
+
+/*! every command: name, letters, handler, flags */
+#define FTP_COMMANDS(X) \
+  X(ALLO, 'A','L','L','O', ALLO, 0)           \
+  X(APPE, 'A','P','P','E', APPE, CMD_RESTART) \
+  X(CDUP, 'C','D','U','P', CDUP, 0)           \
+  X(CWD,  'C','W','D', 0,  CWD,  0)           \
+  X(DELE, 'D','E','L','E', DELE, 0)           \
+  X(FEAT, 'F','E','A','T', FEAT, 0)           \
+  X(LIST, 'L','I','S','T', LIST, 0)           \
+  X(MKD,  'M','K','D', 0,  MKD,  0)           \
+  X(MLSD, 'M','L','S','D', MLSD, 0)           \
+  X(MLST, 'M','L','S','T', MLST, 0)           \
+  X(MODE, 'M','O','D','E', MODE, 0)           \
+  X(NLST, 'N','L','S','T', NLST, 0)           \
+  X(NOOP, 'N','O','O','P', NOOP, 0)           \
+  X(OPTS, 'O','P','T','S', OPTS, 0)           \
+  X(PASS, 'P','A','S','S', PASS, 0)           \
+  X(PASV, 'P','A','S','V', PASV, 0)           \
+  X(PORT, 'P','O','R','T', PORT, 0)           \
+  X(PWD,  'P','W','D', 0,  PWD,  0)           \
+  X(QUIT, 'Q','U','I','T', QUIT, 0)           \
+  X(REST, 'R','E','S','T', REST, 0)           \
+  X(RETR, 'R','E','T','R', RETR, CMD_RESTART) \
+  X(RMD,  'R','M','D', 0,  RMD,  0)           \
+  X(RNFR, 'R','N','F','R', RNFR, 0)           \
+  X(RNTO, 'R','N','T','O', RNTO, CMD_RENAME)  \
+  X(SITE, 'S','I','T','E', SITE, 0)           \
+  X(STAT, 'S','T','A','T', STAT, 0)           \
+  X(STOR, 'S','T','O','R', STOR, CMD_RESTART) \
+  X(STOU, 'S','T','O','U', STOU, 0)           \
+  X(STRU, 'S','T','R','U', STRU, 0)           \
+  X(SYST, 'S','Y','S','T', SYST, 0)           \
+  X(TYPE, 'T','Y','P','E', TYPE, 0)           \
+  X(USER, 'U','S','E','R', USER, 0)           \
+  X(XCUP, 'X','C','U','P', CDUP, 0)           \
+  X(XMKD, 'X','M','K','D', MKD,  0)           \
+  X(XPWD, 'X','P','W','D', PWD,  0)           \
+  X(XRMD, 'X','R','M','D', RMD,  0)
+
+/*! perfect hash table of ftp commands, indexed by CMD_SLOT() */
+static const ftp_command_t ftp_commands[CMD_SLOTS] =
+{
+#define FTP_COMMAND(x,a,b,c,d,handler,flags) \
+  [CMD_SLOT(CMD_KEY(a,b,c,d))] = { #x, handler, CMD_KEY(a,b,c,d), flags, },
+  FTP_COMMANDS(FTP_COMMAND)
+#undef FTP_COMMAND
 };
-/*! number of ftp commands */
-static const size_t num_ftp_commands = sizeof(ftp_commands)/sizeof(ftp_commands[0]);
 
-/*! compare ftp command descriptors
+/*! ftp_commands slots in alphabetical order */
+static const unsigned char ftp_command_order[] =
+{
+#define FTP_COMMAND(x,a,b,c,d,handler,flags) CMD_SLOT(CMD_KEY(a,b,c,d)),
+  FTP_COMMANDS(FTP_COMMAND)
+#undef FTP_COMMAND
+};
+
+/* a collision would silently replace a command; make it a build error */
+#define FTP_COMMAND(x,a,b,c,d,handler,flags) | (1ULL << CMD_SLOT(CMD_KEY(a,b,c,d)))
+#define FTP_COUNT(x,a,b,c,d,handler,flags)   + 1
+_Static_assert(__builtin_popcountll(0 FTP_COMMANDS(FTP_COMMAND)) == 0 FTP_COMMANDS(FTP_COUNT),
+               "ftp command slots collide; pick another CMD_SLOT multiplier");
+#undef FTP_COMMAND
+#undef FTP_COUNT
+
+/*! look up an ftp command
  *
- *  @param[in] p1 left side of comparison (ftp_command_t*)
- *  @param[in] p2 right side of comparison (ftp_command_t*)
+ *  @param[in] name command name, in any case
  *
- *  @returns <0 if p1 <  p2
- *  @returns 0 if  p1 == p2
- *  @returns >0 if p1 >  p2
+ *  @returns command descriptor
+ *  @returns NULL if there is no such command
  */
-static int
-ftp_command_cmp(const void *p1,
-                const void *p2)
+static const ftp_command_t*
+ftp_command_find(const char *name)
 {
-  ftp_command_t *c1 = (ftp_command_t*)p1;
-  ftp_command_t *c2 = (ftp_command_t*)p2;
+  const ftp_command_t *command;
+  size_t              len = strlen(name);
+  uint32_t            key;
+
+  if(len < 3 || len > 4)
+    return NULL;
 
-  /* ordered by command name */
-  return strcasecmp(c1->name, c2->name);
+  /* clearing bit 5 folds lower case letters onto upper case ones; no other
+   * byte folds onto a letter, so the key comparison below stays exact
+   */
+  key = CMD_KEY(name[0] & ~0x20, name[1] & ~0x20, name[2] & ~0x20, name[3] & ~0x20);
+
+  command = &ftp_commands[CMD_SLOT(key)];
+  return command->key == key ? command : NULL;
 }
 
 #ifdef _3DS
@@ -194,12 +561,178 @@ static struct sockaddr_in serv_addr;
 static int                listenfd = -1;
 #ifdef _3DS
 /*! current data port */
-static in_port_t          data_port = DATA_PORT;
+static unsigned int       data_port = 0;
 #endif
-/*! list of ftp sessions */
-static ftp_session_t      *sessions = NULL;
+#ifdef _3DS
 /*! socket buffersize */
 static int                sock_buffersize = SOCK_BUFFERSIZE;
+#endif
+/*! session workers; the first one is run by ftp_loop() */
+static ftp_worker_t       *workers = NULL;
+/*! number of session workers */
+static unsigned int       num_workers = 0;
+/*! event engine registration for listen socket */
+static ftp_watch_t        listen_watch = { NULL, WATCH_CMD, -1, 0, -1, };
+/*! metrics listen file descriptor (-1 if disabled) */
+static int                metricsfd = -1;
+/*! event engine registration for metrics listen socket */
+static ftp_watch_t        metrics_watch = { NULL, WATCH_CMD, -1, 0, -1, };
+/*! metrics requests being read; served by the first worker */
+static ftp_scrape_t       scrapes[MAX_SCRAPES];
+/*! directory listings shared by all workers */
+static listcache_t        list_cache;
+
+/*! ftp server settings */
+ftp_config_t ftp_config =
+{
+  0,        /* workers (one per core) */
+  0x40000,  /* quantum */
+#ifdef _3DS
+  0x80000,  /* list_cache */
+#else
+  0x400000, /* list_cache */
+#endif
+  10,       /* list_ttl */
+#ifdef _3DS
+  0,        /* stat_threads */
+#else
+  4,        /* stat_threads */
+#endif
+  0,        /* metrics_port (disabled) */
+};
+
+/*! get monotonic time
+ *
+ *  @returns microseconds since an arbitrary point
+ */
+static uint64_t
+ftp_time(void)
+{
+#ifdef _3DS
+  return svcGetSystemTick() / (SYSCLOCK_ARM11/1000000);
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+#endif
+}
+
+/*! initialize block allocator
+ *
+ *  @param[out] pool     allocator to initialize
+ *  @param[in]  size     block size
+ *  @param[in]  per_slab blocks to allocate at once
+ *  @param[in]  max_free free blocks to keep (only if per_slab is 1)
+ */
+static void
+ftp_pool_init(ftp_pool_t *pool,
+              size_t     size,
+              size_t     per_slab,
+              size_t     max_free)
+{
+  /* blocks must be able to hold the free list link */
+  pool->size     = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  pool->per_slab = per_slab;
+  pool->max_free = max_free;
+  pool->num_free = 0;
+  pool->free     = NULL;
+  pool->slabs    = NULL;
+}
+
+/*! get a block from an allocator
+ *
+ *  @param[in] pool allocator
+ *
+ *  @returns NULL for error
+ */
+static void*
+ftp_pool_get(ftp_pool_t *pool)
+{
+  char   *slab;
+  size_t i;
+
+  if(pool->free == NULL)
+  {
+    /* single blocks are buffers; keep them page-aligned for the kernel */
+    if(pool->per_slab == 1)
+      return memalign(XFER_ALIGN, pool->size);
+
+    /* carve a new slab into free blocks; the first word links the slabs */
+    slab = (char*)malloc(sizeof(void*) + pool->per_slab*pool->size);
+    if(slab == NULL)
+      return NULL;
+
+    *(void**)slab = pool->slabs;
+    pool->slabs   = slab;
+    slab         += sizeof(void*);
+
+    for(i = 0; i < pool->per_slab; ++i)
+    {
+      *(void**)(slab + i*pool->size) = pool->free;
+      pool->free = slab + i*pool->size;
+    }
+    pool->num_free += pool->per_slab;
+  }
+
+  slab       = (char*)pool->free;
+  pool->free = *(void**)slab;
+  --pool->num_free;
+
+  return slab;
+}
+
+/*! return a block to an allocator
+ *
+ *  @param[in] pool  allocator
+ *  @param[in] block block from ftp_pool_get()
+ */
+static void
+ftp_pool_put(ftp_pool_t *pool,
+             void       *block)
+{
+  if(pool->per_slab == 1 && pool->num_free >= pool->max_free)
+  {
+    free(block);
+    return;
+  }
+
+  *(void**)block = pool->free;
+  pool->free     = block;
+  ++pool->num_free;
+}
+
+/*! deinitialize block allocator
+ *
+ *  @param[in] pool allocator
+ *
+ *  @note every block must have been returned
+ */
+static void
+ftp_pool_exit(ftp_pool_t *pool)
+{
+  void *next;
+
+  if(pool->per_slab == 1)
+  {
+    while(pool->free != NULL)
+    {
+      next = *(void**)pool->free;
+      free(pool->free);
+      pool->free = next;
+    }
+  }
+
+  while(pool->slabs != NULL)
+  {
+    next = *(void**)pool->slabs;
+    free(pool->slabs);
+    pool->slabs = next;
+  }
+
+  pool->free     = NULL;
+  pool->num_free = 0;
+}
 
 /*! Allocate a new data port
  *
@@ -209,9 +742,9 @@ static in_port_t
 next_data_port(void)
 {
 #ifdef _3DS
-  if(++data_port >= 10000)
-    data_port = DATA_PORT;
-  return data_port;
+  /* shared by all workers */
+  return DATA_PORT + 1
+       + __atomic_fetch_add(&data_port, 1, __ATOMIC_RELAXED) % (10000 - DATA_PORT - 1);
 #else
   return 0; /* ephemeral port */
 #endif
@@ -252,6 +785,7 @@ ftp_set_socket_nonblocking(int fd)
 static void
 ftp_set_socket_options(int fd)
 {
+#ifdef _3DS
   int rc;
 
   /* it's okay if this fails */
@@ -269,6 +803,12 @@ ftp_set_socket_options(int fd)
   {
     console_print(RED "setsockopt: %d %s\n" RESET, errno, strerror(errno));
   }
+#else
+  /* fixed buffer sizes disable the kernel's autotuning; with sendfile()
+   * a send buffer of one segment stalls on delayed ACKs
+   */
+  (void)fd;
+#endif
 }
 
 /*! close a socket
@@ -308,1185 +848,5268 @@ ftp_closesocket(int fd, int connected)
     console_print(RED "close: %d %s\n" RESET, errno, strerror(errno));
 }
 
-/*! close command socket on ftp session
+/*! get the socket for an event engine registration
  *
  *  @param[in] session ftp session
+ *  @param[in] kind    which session socket
+ *
+ *  @returns socket
  */
-static void
-ftp_session_close_cmd(ftp_session_t *session)
+static int
+ftp_session_fd(ftp_session_t *session,
+               watch_kind_t  kind)
 {
-  /* close command socket */
-  ftp_closesocket(session->cmd_fd, 1);
-  session->cmd_fd = -1;
+  switch(kind)
+  {
+    case WATCH_CMD:  return session->cmd_fd;
+    case WATCH_PASV: return session->pasv_fd;
+    case WATCH_DATA: return session->data_fd;
+    default:         return -1;
+  }
 }
 
-/*! close listen socket on ftp session
+/*! get the events a session is waiting on for one of its sockets
  *
  *  @param[in] session ftp session
+ *  @param[in] kind    which session socket
+ *
+ *  @returns poll events (0 if the socket is not needed in this state)
  */
-static void
-ftp_session_close_pasv(ftp_session_t *session)
+static int
+ftp_session_wants(ftp_session_t *session,
+                  watch_kind_t  kind)
 {
-  console_print(YELLOW "stop listening on %s:%u\n" RESET,
-                inet_ntoa(session->pasv_addr.sin_addr),
-                ntohs(session->pasv_addr.sin_port));
+  int events = 0;
 
-  /* close pasv socket */
-  ftp_closesocket(session->pasv_fd, 0);
-  session->pasv_fd = -1;
-}
+  if(kind == WATCH_CMD)
+  {
+    /* replies the end of the round couldn't send go out when there is room */
+    if(session->out_pos != session->out_size && !session->flush_queued)
+      events |= POLLOUT;
+
+    /* we are waiting to read a command, unless the peer isn't reading
+     * our replies
+     */
+    if(session->state == COMMAND_STATE
+    && session->out_size - session->out_pos < OUT_BUFFERSIZE)
+      events |= POLLIN;
+
+    return events;
+  }
 
-/*! close data socket on ftp session
- *
- *  @param[in] session ftp session */
-static void
-ftp_session_close_data(ftp_session_t *session)
-{
-  /* close data connection */
-  ftp_closesocket(session->data_fd, 1);
-  session->data_fd = -1;
+  switch(session->state)
+  {
+    case COMMAND_STATE:
+      /* only the command socket is needed */
+      return 0;
 
-  /* clear send/recv flags */
-  session->flags &= ~(SESSION_RECV|SESSION_SEND);
-}
+    case DATA_CONNECT_STATE:
+      /* we are waiting for a PASV connection */
+      return kind == WATCH_PASV ? POLLIN : 0;
 
-/*! close open file for ftp session
- *
- *  @param[in] session ftp session
- */
-static void
-ftp_session_close_file(ftp_session_t *session)
-{
-  int rc;
+    case DATA_TRANSFER_STATE:
+      /* we need to transfer data */
+      if(kind != WATCH_DATA)
+        return 0;
+#ifdef FTP_USE_IO_URING
+      /* io_uring completions drive the transfer, not readiness */
+      if(session->io_buffer >= 0)
+        return 0;
+#endif
+      /* a stat thread wakes us up when the next entry is ready */
+      if(session->prefetch != NULL
+      && __atomic_load_n(&session->prefetch->waiting, __ATOMIC_RELAXED))
+        return 0;
 
-  rc = fclose(session->fp);
-  if(rc != 0)
-    console_print(RED "fclose: %d %s\n" RESET, errno, strerror(errno));
-  session->fp = NULL;
+      /* the disk thread wakes us up when it has filled or freed a buffer */
+      if(session->stage != NULL)
+      {
+        ftp_stage_t *stage = session->stage;
+
+        if(stage->store)
+        {
+          /* stop receiving while the ring is full */
+          if(stage->eof
+          || stage->head - __atomic_load_n(&stage->tail, __ATOMIC_ACQUIRE) == STAGE_BUFFERS)
+            return 0;
+        }
+        else if(__atomic_load_n(&stage->head, __ATOMIC_ACQUIRE) == stage->tail)
+          return 0;
+      }
+      return (session->flags & SESSION_RECV) ? POLLIN : POLLOUT;
+  }
+
+  return 0;
 }
 
-/*! open file for reading for ftp session
+#ifdef FTP_USE_EPOLL
+/*! update an epoll registration
  *
- *  @param[in] session ftp session
+ *  @param[in] worker worker owning the registration
+ *  @param[in] watch  registration
+ *  @param[in] fd     socket to watch (-1 if it is about to be closed)
+ *  @param[in] events poll events to watch for
  *
- *  @returns -1 for error
+ *  @note registrations are edge-triggered, so handlers must consume until
+ *        EWOULDBLOCK or change state; changing the events re-arms the socket
  */
-static int
-ftp_session_open_file_read(ftp_session_t *session)
+static void
+ftp_watch_set(ftp_worker_t *worker,
+              ftp_watch_t  *watch,
+              int          fd,
+              int          events)
 {
-  int         rc;
-  struct stat st;
+  int                rc, op;
+  struct epoll_event ev;
 
-  /* open file in read mode */
-  session->fp = fopen(session->buffer, "rb");
-  if(session->fp == NULL)
+  if(fd < 0)
   {
-    console_print(RED "fopen '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
-    return -1;
+    /* closing the socket removes it from the epoll set */
+    watch->fd     = -1;
+    watch->events = 0;
+    return;
   }
 
-  /* it's okay if this fails */
-  errno = 0;
-  rc = setvbuf(session->fp, session->file_buffer, _IOFBF, FILE_BUFFERSIZE);
-  if(rc != 0)
-  {
-    console_print(RED "setvbuf: %d %s\n" RESET, errno, strerror(errno));
-  }
+  if(watch->fd == fd && watch->events == events)
+    return;
 
-  /* get the file size */
-  rc = fstat(fileno(session->fp), &st);
+  /* don't bother registering a socket until it is needed */
+  if(watch->fd != fd && events == 0)
+    return;
+
+  ev.events   = EPOLLET;
+  ev.data.ptr = watch;
+  if(events & POLLIN)
+    ev.events |= EPOLLIN;
+  if(events & POLLOUT)
+    ev.events |= EPOLLOUT;
+
+  op = (watch->fd == fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  rc = epoll_ctl(worker->epollfd, op, fd, &ev);
   if(rc != 0)
   {
-    console_print(RED "fstat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
-    ftp_session_close_file(session);
-    return -1;
+    console_print(RED "epoll_ctl: %d %s\n" RESET, errno, strerror(errno));
+    return;
   }
-  session->filesize = st.st_size;
-
-  /* reset file position */
-  /* TODO: support REST command */
-  session->filepos = 0;
 
-  return 0;
+  watch->fd     = fd;
+  watch->events = events;
 }
 
-/*! read from an open file for ftp session
+/*! wait for ready sockets
  *
- *  @param[in] session ftp session
+ *  @param[in] worker  worker to wait on
+ *  @param[in] timeout poll timeout in milliseconds
  *
- *  @returns bytes read
+ *  @returns number of ready_events
+ *  @returns -1 for error
  */
-static ssize_t
-ftp_session_read_file(ftp_session_t *session)
+static int
+ftp_watch_wait(ftp_worker_t *worker,
+               int          timeout)
 {
-  ssize_t rc;
+  int                rc, i;
+  ftp_event_t        *ready_events = worker->ready_events;
+  struct epoll_event events[MAX_EVENTS];
 
-  /* read file at current position */
-  rc = fread(session->buffer, 1, sizeof(session->buffer), session->fp);
+  rc = epoll_wait(worker->epollfd, events, MAX_EVENTS, timeout);
   if(rc < 0)
   {
-    console_print(RED "fread: %d %s\n" RESET, errno, strerror(errno));
+    if(errno == EINTR)
+      return 0;
+    console_print(RED "epoll_wait: %d %s\n" RESET, errno, strerror(errno));
     return -1;
   }
 
-  /* adjust file position */
-  session->filepos += rc;
+  for(i = 0; i < rc; ++i)
+  {
+    ready_events[i].watch   = (ftp_watch_t*)events[i].data.ptr;
+    ready_events[i].fd      = ready_events[i].watch->fd;
+    ready_events[i].revents = 0;
+    if(events[i].events & EPOLLIN)
+      ready_events[i].revents |= POLLIN;
+    if(events[i].events & EPOLLOUT)
+      ready_events[i].revents |= POLLOUT;
+    if(events[i].events & EPOLLERR)
+      ready_events[i].revents |= POLLERR;
+    if(events[i].events & EPOLLHUP)
+      ready_events[i].revents |= POLLHUP;
+  }
 
   return rc;
 }
-
-/*! open file for writing for ftp session
- *
- *  @param[in] session ftp session
- *
- *  @returns -1 for error
+#else
+/*! update a poll set registration
  *
- *  @note truncates file
+ *  @param[in] worker worker owning the registration
+ *  @param[in] watch  registration
+ *  @param[in] fd     socket to watch (-1 if it is about to be closed)
+ *  @param[in] events poll events to watch for
  */
-static int
-ftp_session_open_file_write(ftp_session_t *session)
+static void
+ftp_watch_set(ftp_worker_t *worker,
+              ftp_watch_t  *watch,
+              int          fd,
+              int          events)
 {
-  int rc;
+  nfds_t slot;
 
-  /* open file in write and create mode with truncation */
-  session->fp = fopen(session->buffer, "wb");
-  if(session->fp == NULL)
+  if(fd < 0 || events == 0)
   {
-    console_print(RED "fopen '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
-    return -1;
+    if(watch->slot >= 0)
+    {
+      /* move the last entry into this slot */
+      slot = watch->slot;
+      if(slot != --worker->num_pollfds)
+      {
+        worker->pollfds[slot]           = worker->pollfds[worker->num_pollfds];
+        worker->pollwatches[slot]       = worker->pollwatches[worker->num_pollfds];
+        worker->pollwatches[slot]->slot = slot;
+      }
+    }
+
+    watch->fd     = -1;
+    watch->events = 0;
+    watch->slot   = -1;
+    return;
   }
 
-  /* it's okay if this fails */
-  errno = 0;
-  rc = setvbuf(session->fp, session->file_buffer, _IOFBF, FILE_BUFFERSIZE);
-  if(rc != 0)
+  if(watch->slot < 0)
   {
-    console_print(RED "setvbuf: %d %s\n" RESET, errno, strerror(errno));
+    if(worker->num_pollfds == worker->max_pollfds)
+    {
+      /* grow the poll set */
+      nfds_t        max = worker->max_pollfds ? 2*worker->max_pollfds : MAX_EVENTS;
+      struct pollfd *pollfds;
+      ftp_watch_t   **pollwatches;
+      ftp_event_t   *ready_events;
+
+      pollfds = (struct pollfd*)realloc(worker->pollfds, max*sizeof(*pollfds));
+      if(pollfds != NULL)
+        worker->pollfds = pollfds;
+      pollwatches = (ftp_watch_t**)realloc(worker->pollwatches, max*sizeof(*pollwatches));
+      if(pollwatches != NULL)
+        worker->pollwatches = pollwatches;
+      ready_events = (ftp_event_t*)realloc(worker->ready_events, max*sizeof(*ready_events));
+      if(ready_events != NULL)
+        worker->ready_events = ready_events;
+
+      if(pollfds == NULL || pollwatches == NULL || ready_events == NULL)
+      {
+        console_print(RED "failed to allocate poll set\n" RESET);
+        return;
+      }
+      worker->max_pollfds = max;
+    }
+
+    watch->slot = worker->num_pollfds++;
+    worker->pollwatches[watch->slot] = watch;
   }
 
-  /* reset file position */
-  /* TODO: support REST command */
-  session->filepos = 0;
+  worker->pollfds[watch->slot].fd      = fd;
+  worker->pollfds[watch->slot].events  = events;
+  worker->pollfds[watch->slot].revents = 0;
 
-  return 0;
+  watch->fd     = fd;
+  watch->events = events;
 }
 
-/*! write to an open file for ftp session
+/*! wait for ready sockets
  *
- *  @param[in] session ftp session
+ *  @param[in] worker  worker to wait on
+ *  @param[in] timeout poll timeout in milliseconds
  *
- *  @returns bytes written
+ *  @returns number of ready_events
+ *  @returns -1 for error
  */
-static ssize_t
-ftp_session_write_file(ftp_session_t *session)
+static int
+ftp_watch_wait(ftp_worker_t *worker,
+               int          timeout)
 {
-  ssize_t rc;
+  int           rc, count = 0;
+  nfds_t        i;
+  struct pollfd *pollfds = worker->pollfds;
 
-  /* write to file at current position */
-  rc = fwrite(session->buffer + session->bufferpos,
-              1, session->buffersize - session->bufferpos,
-              session->fp);
+  /* one poll for every session */
+  rc = poll(pollfds, worker->num_pollfds, timeout);
   if(rc < 0)
   {
-    console_print(RED "fwrite: %d %s\n" RESET, errno, strerror(errno));
+    console_print(RED "poll: %d %s\n" RESET, errno, strerror(errno));
     return -1;
   }
-  else if(rc == 0)
-    console_print(RED "fwrite: wrote 0 bytes\n" RESET);
 
-  /* adjust file position */
-  session->filepos += rc;
+  /* collect ready sockets; handlers may reorder the poll set */
+  for(i = 0; i < worker->num_pollfds && count < rc; ++i)
+  {
+    if(pollfds[i].revents != 0)
+    {
+      worker->ready_events[count].watch   = worker->pollwatches[i];
+      worker->ready_events[count].fd      = pollfds[i].fd;
+      worker->ready_events[count].revents = pollfds[i].revents;
+      ++count;
+    }
+  }
 
-  return rc;
+  return count;
 }
+#endif
 
-/*! close current working directory for ftp session
+/*! synchronize event engine registrations with session state
  *
- *   @param[in] session ftp session
+ *  @param[in] session ftp session
  */
 static void
-ftp_session_close_cwd(ftp_session_t *session)
+ftp_session_watch(ftp_session_t *session)
 {
-  int rc;
+  watch_kind_t kind;
 
-  /* close open directory pointer */
-  rc = closedir(session->dp);
-  if(rc != 0)
-    console_print(RED "closedir: %d %s\n" RESET, errno, strerror(errno));
-  session->dp = NULL;
+  for(kind = WATCH_CMD; kind < NUM_WATCHES; ++kind)
+    ftp_watch_set(session->worker, &session->watch[kind],
+                  ftp_session_fd(session, kind), ftp_session_wants(session, kind));
 }
 
-/*! open current working directory for ftp session
+/*! remove event engine registration of a socket about to be closed
  *
  *  @param[in] session ftp session
+ *  @param[in] kind    which session socket
+ */
+static void
+ftp_session_unwatch(ftp_session_t *session,
+                    watch_kind_t  kind)
+{
+  ftp_watch_set(session->worker, &session->watch[kind], -1, 0);
+}
+
+/*! send queued replies for ftp session
  *
- *  @return -1 for failure
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 if the command connection failed
+ *
+ *  @note what the socket can't take now stays queued for POLLOUT
  */
 static int
-ftp_session_open_cwd(ftp_session_t *session)
+ftp_session_flush(ftp_session_t *session)
 {
-  /* open current working directory */
-  session->dp = opendir(session->cwd);
-  if(session->dp == NULL)
+  ssize_t rc;
+
+  while(session->out_pos != session->out_size)
   {
-    console_print(RED "opendir '%s': %d %s\n" RESET, session->cwd, errno, strerror(errno));
-    return -1;
+    rc = send(session->cmd_fd, session->out_buffer + session->out_pos,
+              session->out_size - session->out_pos, 0);
+    if(rc < 0)
+    {
+      if(errno == EWOULDBLOCK)
+        return 0;
+
+      console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
+      session->out_pos = session->out_size = 0;
+      return -1;
+    }
+
+    /* a short send leaves the rest for the next try */
+    session->out_pos += rc;
   }
 
+  session->out_pos = session->out_size = 0;
   return 0;
 }
 
-/*! set state for ftp session
+/*! close command socket on ftp session
  *
  *  @param[in] session ftp session
- *  @param[in] state   state to set
  */
 static void
-ftp_session_set_state(ftp_session_t   *session,
-                      session_state_t state)
+ftp_session_close_cmd(ftp_session_t *session)
 {
-  session->state = state;
+  /* give the last replies (like QUIT's) a chance to go out */
+  ftp_session_flush(session);
+  session->out_pos = session->out_size = 0;
 
-  switch(state)
-  {
-    case COMMAND_STATE:
-      /* close pasv and data sockets */
-      if(session->pasv_fd >= 0)
-        ftp_session_close_pasv(session);
-      if(session->data_fd >= 0)
-        ftp_session_close_data(session);
-      break;
+  /* close command socket */
+  ftp_session_unwatch(session, WATCH_CMD);
+  ftp_closesocket(session->cmd_fd, 1);
+  session->cmd_fd = -1;
 
-    case DATA_CONNECT_STATE:
-      /* close data socket; we are listening for a new one */
-      if(session->data_fd >= 0)
-        ftp_session_close_data(session);
-      break;
+  /* session will be destroyed after this round of events */
+  session->worker->reap_sessions = 1;
+}
 
-    case DATA_TRANSFER_STATE:
-      /* close pasv socket; we are connecting for a new one */
-      if(session->pasv_fd >= 0)
-        ftp_session_close_pasv(session);
-  }
+/*! close listen socket on ftp session
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_close_pasv(ftp_session_t *session)
+{
+  console_print(YELLOW "stop listening on %s:%u\n" RESET,
+                inet_ntoa(session->pasv_addr.sin_addr),
+                ntohs(session->pasv_addr.sin_port));
+
+  /* close pasv socket */
+  ftp_session_unwatch(session, WATCH_PASV);
+  ftp_closesocket(session->pasv_fd, 0);
+  session->pasv_fd = -1;
 }
 
+/*! close data socket on ftp session
+ *
+ *  @param[in] session ftp session */
 static void
-ftp_session_transfer(ftp_session_t *session)
+ftp_session_close_data(ftp_session_t *session)
 {
-  int rc;
-  do
-  {
-    rc = session->transfer(session);
-  } while(rc == 0);
+  /* close data connection */
+  ftp_session_unwatch(session, WATCH_DATA);
+  ftp_closesocket(session->data_fd, 1);
+  session->data_fd = -1;
+
+  /* clear send/recv flags */
+  session->flags &= ~(SESSION_RECV|SESSION_SEND);
 }
 
-__attribute__((format(printf,3,4)))
-/*! send ftp response to ftp session's peer
+/*! attach transfer buffer to ftp session
  *
  *  @param[in] session ftp session
- *  @param[in] code    response code
- *  @param[in] fmt     format string
- *  @param[in] ...     format arguments
  *
- *  returns bytes send to peer
+ *  @returns -1 for error
  */
-static ssize_t
-ftp_send_response(ftp_session_t *session,
-                  int           code,
-                  const char    *fmt, ...)
+static int
+ftp_session_get_buffer(ftp_session_t *session)
 {
-  static char buffer[CMD_BUFFERSIZE];
-  ssize_t     rc, to_send;
-  va_list     ap;
-
-  /* print response code and message to buffer */
-  va_start(ap, fmt);
-  if(code != 211)
-    rc = sprintf(buffer, "%d ", code);
-  else
-    rc = sprintf(buffer, "%d- ", code);
-  rc += vsnprintf(buffer+rc, sizeof(buffer)-rc, fmt, ap);
-  va_end(ap);
+  if(session->buffer != NULL)
+    return 0;
 
-  if(rc >= sizeof(buffer))
+  session->buffer = (char*)ftp_pool_get(&session->worker->xfer_pool);
+  if(session->buffer == NULL)
   {
-    /* couldn't fit message; just send code */
-    console_print(RED "%s: buffersize too small\n" RESET, __func__);
-    rc = sprintf(buffer, "%d\r\n", code);
+    console_print(RED "failed to allocate transfer buffer\n" RESET);
+    return -1;
   }
 
-  /* send response */
-  to_send = rc;
-  console_print(GREEN "%s" RESET, buffer);
-  rc = send(session->cmd_fd, buffer, to_send, 0);
-  if(rc < 0)
-    console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
-  else if(rc != to_send)
-    console_print(RED "only sent %u/%u bytes\n" RESET,
-                  (unsigned int)rc, (unsigned int)to_send);
-
-  return rc;
+  return 0;
 }
 
-/*! destroy ftp session
+/*! release transfer buffer of ftp session
  *
  *  @param[in] session ftp session
  */
-static ftp_session_t*
-ftp_session_destroy(ftp_session_t *session)
+static void
+ftp_session_put_buffer(ftp_session_t *session)
 {
-  ftp_session_t *next = session->next;
-
-  /* close all sockets */
-  if(session->cmd_fd >= 0)
-    ftp_session_close_cmd(session);
-  if(session->pasv_fd >= 0)
-    ftp_session_close_pasv(session);
-  if(session->data_fd >= 0)
-    ftp_session_close_data(session);
-
-  /* unlink from sessions list */
-  if(session->next)
-    session->next->prev = session->prev;
-  if(session == sessions)
-    sessions = session->next;
-  else
-  {
-    session->prev->next = session->next;
-    if(session == sessions->prev)
-      sessions->prev = session->prev;
-  }
-
-  /* deallocate */
-  free(session);
+  if(session->buffer == NULL)
+    return;
 
-  return next;
+  ftp_pool_put(&session->worker->xfer_pool, session->buffer);
+  session->buffer = NULL;
 }
 
-/*! allocate new ftp session
+/*! close open file for ftp session
  *
- *  @param[in] listen_fd socket to accept connection from
+ *  @param[in] session ftp session
  */
 static void
-ftp_session_new(int listen_fd)
+ftp_session_close_file(ftp_session_t *session)
 {
-  ssize_t            rc;
-  int                new_fd;
-  ftp_session_t      *session;
-  struct sockaddr_in addr;
-  socklen_t          addrlen = sizeof(addr);
+  int rc;
 
-  /* accept connection */
-  new_fd = accept(listen_fd, (struct sockaddr*)&addr, &addrlen);
-  if(new_fd < 0)
-  {
-    console_print(RED "accept: %d %s\n" RESET, errno, strerror(errno));
-    return;
-  }
+  rc = close(session->file_fd);
+  if(rc != 0)
+    console_print(RED "close: %d %s\n" RESET, errno, strerror(errno));
+  session->file_fd = -1;
+}
 
-  console_print(CYAN "accepted connection from %s:%u\n" RESET,
-                inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+/*! open file for reading for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for error
+ */
+static int
+ftp_session_open_file_read(ftp_session_t *session)
+{
+  int         rc;
+  struct stat st;
 
-  /* allocate a new session */
-  session = (ftp_session_t*)malloc(sizeof(ftp_session_t));
-  if(session == NULL)
+  /* open file in read mode; transfers go straight to the fd, not stdio */
+  session->file_fd = open(session->buffer, O_RDONLY);
+  if(session->file_fd < 0)
   {
-    console_print(RED "failed to allocate session\n" RESET);
-    ftp_closesocket(new_fd, 1);
-    return;
+    console_print(RED "open '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    return -1;
   }
 
-  /* initialize session */
-  memset(session->cwd, 0, sizeof(session->cwd));
-  strcpy(session->cwd, "/");
-  session->peer_addr.sin_addr.s_addr = INADDR_ANY;
-  session->cmd_fd   = new_fd;
-  session->pasv_fd  = -1;
-  session->data_fd  = -1;
-  session->flags    = 0;
-  session->state    = COMMAND_STATE;
-  session->next     = NULL;
-  session->prev     = NULL;
-  session->transfer = NULL;
-
-  /* link to the sessions list */
-  if(sessions == NULL)
-  {
-    sessions = session;
-    session->prev = session;
-  }
-  else
+  /* get the file size */
+  rc = fstat(session->file_fd, &st);
+  if(rc != 0)
   {
-    sessions->prev->next = session;
-    session->prev        = sessions->prev;
-    sessions->prev       = session;
+    console_print(RED "fstat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    ftp_session_close_file(session);
+    return -1;
   }
+  session->filesize = st.st_size;
 
-  /* copy socket address to pasv address */
-  addrlen = sizeof(session->pasv_addr);
-  rc = getsockname(new_fd, (struct sockaddr*)&session->pasv_addr, &addrlen);
-  if(rc != 0)
+  /* start where REST asked to */
+  session->filepos = session->restart;
+  if(session->filepos != 0
+  && lseek(session->file_fd, session->filepos, SEEK_SET) != (off_t)session->filepos)
   {
-    console_print(RED "getsockname: %d %s\n" RESET, errno, strerror(errno));
-    ftp_send_response(session, 451, "Failed to get connection info\r\n");
-    ftp_session_destroy(session);
-    return;
+    console_print(RED "lseek '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    ftp_session_close_file(session);
+    return -1;
   }
 
-  session->cmd_fd = new_fd;
-
-  /* send initiator response */
-  rc = ftp_send_response(session, 200, "Hello!\r\n");
-  if(rc <= 0)
-    ftp_session_destroy(session);
+  return 0;
 }
 
-/*! accept PASV connection for ftp session
+/*! read from an open file for ftp session
  *
  *  @param[in] session ftp session
  *
- *  @returns -1 for failure
+ *  @returns bytes read
  */
-static int
-ftp_session_accept(ftp_session_t *session)
+static ssize_t
+ftp_session_read_file(ftp_session_t *session)
 {
-  int                rc, new_fd;
-  struct sockaddr_in addr;
-  socklen_t          addrlen = sizeof(addr);
+  ssize_t rc;
 
-  if(session->flags & SESSION_PASV)
+  /* read file at current position */
+  rc = read(session->file_fd, session->buffer, XFER_BUFFERSIZE);
+  ++session->xfer_syscalls;
+  if(rc < 0)
   {
-    /* clear PASV flag */
-    session->flags &= ~SESSION_PASV;
-
-    /* tell the peer that we're ready to accept the connection */
-    ftp_send_response(session, 150, "Ready\r\n");
+    console_print(RED "read: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
 
-    /* accept connection from peer */
-    new_fd = accept(session->pasv_fd, (struct sockaddr*)&addr, &addrlen);
-    if(new_fd < 0)
-    {
-      console_print(RED "accept: %d %s\n" RESET, errno, strerror(errno));
-      ftp_session_set_state(session, COMMAND_STATE);
-      ftp_send_response(session, 425, "Failed to establish connection\r\n");
-      return -1;
-    }
+  /* adjust file position */
+  session->filepos     += rc;
+  session->xfer_copied += rc;
 
-    rc = ftp_set_socket_nonblocking(new_fd);
-    if(rc != 0)
+  return rc;
+}
+
+/*! open file for writing for ftp session
+ *
+ *  @param[in] session ftp session
+ *  @param[in] append  keep the existing file and write after its end
+ *
+ *  @returns -1 for error
+ *
+ *  @note truncates file to the REST offset
+ */
+static int
+ftp_session_open_file_write(ftp_session_t *session,
+                            int           append)
+{
+  int   flags = O_WRONLY|O_CREAT;
+  off_t end;
+
+  /* truncate unless resuming or appending */
+  if(session->restart == 0 && !append)
+    flags |= O_TRUNC;
+
+  /* open file in write and create mode */
+  session->file_fd = open(session->buffer, flags, 0644);
+  if(session->file_fd < 0)
+  {
+    console_print(RED "open '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    return -1;
+  }
+
+  if(append && session->restart == 0)
+  {
+    /* seek instead of O_APPEND; splice() refuses O_APPEND files */
+    end = lseek(session->file_fd, 0, SEEK_END);
+    if(end < 0)
     {
-      ftp_closesocket(new_fd, 1);
-      ftp_session_set_state(session, COMMAND_STATE);
-      ftp_send_response(session, 425, "Failed to establish connection\r\n");
+      console_print(RED "lseek '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+      ftp_session_close_file(session);
       return -1;
     }
 
-    console_print(CYAN "accepted connection from %s:%u\n" RESET,
-                  inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
-
-    ftp_session_set_state(session, DATA_TRANSFER_STATE);
-    session->data_fd = new_fd;
-
+    session->filepos = end;
     return 0;
   }
-  else
+
+  /* drop what was past the REST offset and continue from there */
+  session->filepos = session->restart;
+  if(session->filepos != 0
+  && (ftruncate(session->file_fd, session->filepos) != 0
+   || lseek(session->file_fd, session->filepos, SEEK_SET) != (off_t)session->filepos))
   {
-    /* peer didn't send PASV command */
-    ftp_send_response(session, 503, "Bad sequence of commands\r\n");
+    console_print(RED "ftruncate '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    ftp_session_close_file(session);
     return -1;
   }
+
+  return 0;
 }
 
-/*! connect to peer for ftp session
+/*! write to an open file for ftp session
  *
  *  @param[in] session ftp session
  *
- *  @returns -1 for failure
+ *  @returns bytes written
  */
-static int
-ftp_session_connect(ftp_session_t *session)
+static ssize_t
+ftp_session_write_file(ftp_session_t *session)
 {
-  int rc;
-
-  /* clear PORT flag */
-  session->flags &= ~SESSION_PORT;
+  ssize_t rc;
 
-  /* create a new socket */
-  session->data_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if(session->data_fd < 0)
+  /* write to file at current position */
+  rc = write(session->file_fd, session->buffer + session->bufferpos,
+             session->buffersize - session->bufferpos);
+  ++session->xfer_syscalls;
+  if(rc < 0)
   {
-    console_print(RED "socket: %d %s\n" RESET, errno, strerror(errno));
+    console_print(RED "write: %d %s\n" RESET, errno, strerror(errno));
     return -1;
   }
+  else if(rc == 0)
+    console_print(RED "write: wrote 0 bytes\n" RESET);
+  session->xfer_copied += rc;
 
-  /* set socket options */
-  ftp_set_socket_options(session->data_fd);
+  /* adjust file position */
+  session->filepos += rc;
 
-  /* connect to peer */
-  rc = connect(session->data_fd, (struct sockaddr*)&session->peer_addr,
-               sizeof(session->peer_addr));
+  return rc;
+}
+
+#ifdef FTP_USE_SPLICE
+/*! open pipe used to splice uploads into files for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for error
+ *
+ *  @note the pipe is kept for the lifetime of the session
+ */
+static int
+ftp_session_open_pipe(ftp_session_t *session)
+{
+  int rc;
+
+  if(session->pipe_fd[0] >= 0)
+    return 0;
+
+  rc = pipe2(session->pipe_fd, O_CLOEXEC);
   if(rc != 0)
   {
-    console_print(RED "connect: %d %s\n" RESET, errno, strerror(errno));
-    ftp_closesocket(session->data_fd, 0);
-    session->data_fd = -1;
+    console_print(RED "pipe2: %d %s\n" RESET, errno, strerror(errno));
+    session->pipe_fd[0] = session->pipe_fd[1] = -1;
     return -1;
   }
 
-  rc = ftp_set_socket_nonblocking(session->data_fd);
-  if(rc != 0)
-    return -1;
+  /* it's okay if this fails; we get the default size */
+  fcntl(session->pipe_fd[1], F_SETPIPE_SZ, PIPE_BUFFERSIZE);
 
-  console_print(CYAN "connected to %s:%u\n" RESET,
-                inet_ntoa(session->peer_addr.sin_addr),
-                ntohs(session->peer_addr.sin_port));
+  rc = fcntl(session->pipe_fd[1], F_GETPIPE_SZ);
+  session->pipe_size = rc > 0 ? rc : XFER_BUFFERSIZE;
 
   return 0;
 }
+#endif
 
-/*! read command for ftp session
+/*! free a stage and close its file
  *
- *  @param[in] session ftp session
+ *  @param[in] worker worker owning the stage
+ *  @param[in] stage  stage which the disk thread no longer uses
+ *
+ *  @returns -1 if a disk operation or closing the file failed
  */
-static void
-ftp_session_read_command(ftp_session_t *session)
+static int
+ftp_worker_free_stage(ftp_worker_t *worker,
+                      ftp_stage_t  *stage)
 {
-  static char   buffer[CMD_BUFFERSIZE];
-  ssize_t       rc;
-  char          *args;
-  ftp_command_t key, *command;
+  int i, rc = stage->error != 0 ? -1 : 0;
 
-  memset(buffer, 0, sizeof(buffer));
+  if(stage->fd >= 0 && close(stage->fd) != 0)
+  {
+    console_print(RED "close: %d %s\n" RESET, errno, strerror(errno));
+    rc = -1;
+  }
 
-  /* retrieve command */
-  rc = recv(session->cmd_fd, buffer, sizeof(buffer), 0);
-  if(rc < 0)
+  for(i = 0; i < STAGE_BUFFERS; ++i)
   {
-    /* error retrieving command */
-    console_print(RED "recv: %d %s\n" RESET, errno, strerror(errno));
-    ftp_session_close_cmd(session);
-    return;
+    if(stage->buffer[i] != NULL)
+      ftp_pool_put(&worker->xfer_pool, stage->buffer[i]);
   }
-  if(rc == 0)
+  ftp_pool_put(&worker->stage_pool, stage);
+
+  return rc;
+}
+
+/*! hand the open file of ftp session to the disk thread
+ *
+ *  @param[in] session ftp session
+ *  @param[in] store   the disk thread writes the file instead of reading it
+ *
+ *  @returns -1 if the worker has no disk thread or no memory
+ */
+static int
+ftp_session_get_stage(ftp_session_t *session,
+                      int           store)
+{
+  ftp_worker_t *worker = session->worker;
+  ftp_stage_t  *stage;
+  int          i;
+
+  if(!worker->disk_running)
+    return -1;
+
+  stage = (ftp_stage_t*)ftp_pool_get(&worker->stage_pool);
+  if(stage == NULL)
   {
-    /* peer closed connection */
-    ftp_session_close_cmd(session);
-    return;
+    console_print(RED "failed to allocate transfer stage\n" RESET);
+    return -1;
   }
-  else
+
+  memset(stage, 0, sizeof(*stage));
+  stage->fd = -1;
+  for(i = 0; i < STAGE_BUFFERS; ++i)
   {
-    /* split into command and arguments */
-    /* TODO: support partial transfers */
-    buffer[sizeof(buffer)-1] = 0;
-
-    args = buffer;
-    while(*args && *args != '\r' && *args != '\n')
-      ++args;
-    *args = 0;
-    
-    args = buffer;
-    while(*args && !isspace((int)*args))
-      ++args;
-    if(*args)
-      *args++ = 0;
-
-    /* look up the command */
-    key.name = buffer;
-    command = bsearch(&key, ftp_commands,
-                      num_ftp_commands, sizeof(ftp_command_t),
-                      ftp_command_cmp);
-
-    /* execute the command */
-    if(command == NULL)
-    {
-      ftp_send_response(session, 502, "invalid command -> %s %s\r\n",
-                        key.name, args);
-    }
-    else
+    stage->buffer[i] = (char*)ftp_pool_get(&worker->xfer_pool);
+    if(stage->buffer[i] == NULL)
     {
-      /* clear RENAME flag for all commands except RNTO */
-      if(strcasecmp(command->name, "RNTO") != 0)
-        session->flags &= ~SESSION_RENAME;
-      command->handler(session, args);
+      console_print(RED "failed to allocate transfer buffer\n" RESET);
+      ftp_worker_free_stage(worker, stage);
+      return -1;
     }
   }
+
+  /* the disk thread owns the file from now on */
+  stage->session   = session;
+  stage->store     = store;
+  stage->fd        = session->file_fd;
+  session->file_fd = -1;
+  session->stage   = stage;
+
+  return 0;
 }
 
-/*! poll sockets for ftp session
+/*! ask the disk thread to serve the stage of ftp session
  *
  *  @param[in] session ftp session
- *
- *  @returns next session
  */
-static ftp_session_t*
-ftp_session_poll(ftp_session_t *session)
+static void
+ftp_session_queue_stage(ftp_session_t *session)
 {
-  int           rc;
-  struct pollfd pollinfo;
+  ftp_worker_t *worker = session->worker;
+  ftp_stage_t  *stage  = session->stage;
+  int          wake    = 0;
 
-  switch(session->state)
+  mutex_lock(&worker->lock);
+  if(!stage->queued)
   {
-    case COMMAND_STATE:
-      /* we are waiting to read a command */
-      pollinfo.fd      = session->cmd_fd;
-      pollinfo.events  = POLLIN;
-      pollinfo.revents = 0;
-      break;
+    stage->queued = 1;
+    stage->next   = NULL;
+    if(worker->disk_tail != NULL)
+      worker->disk_tail->next = stage;
+    else
+      worker->disk_head = stage;
+    worker->disk_tail = stage;
+    wake = 1;
+  }
+  mutex_unlock(&worker->lock);
 
-    case DATA_CONNECT_STATE:
-      /* we are waiting for a PASV connection */
-      pollinfo.fd      = session->pasv_fd;
-      pollinfo.events  = POLLIN;
-      pollinfo.revents = 0;
-      break;
+  if(wake)
+    event_signal(&worker->disk_event);
+}
 
-    case DATA_TRANSFER_STATE:
-      /* we need to transfer data */
-      pollinfo.fd = session->data_fd;
-      if(session->flags & SESSION_RECV)
-        pollinfo.events = POLLIN;
-      else
-        pollinfo.events = POLLOUT;
-      pollinfo.revents = 0;
-      break;
-  }
+/*! detach the stage from ftp session and close its file
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 if a disk operation or closing the file failed
+ *
+ *  @note if the disk thread is still using the stage, it is freed when the
+ *        disk thread lets go of it
+ */
+static int
+ftp_session_put_stage(ftp_session_t *session)
+{
+  ftp_worker_t *worker = session->worker;
+  ftp_stage_t  *stage  = session->stage, **link;
+  int          busy;
 
-  /* poll the selected socket */
-  rc = poll(&pollinfo, 1, 0);
-  if(rc < 0)
-    console_print(RED "poll: %d %s\n" RESET, errno, strerror(errno));
-  else if(rc > 0)
+  if(stage == NULL)
+    return 0;
+  session->stage = NULL;
+
+  mutex_lock(&worker->lock);
+  stage->session = NULL;
+  __atomic_store_n(&stage->cancel, 1, __ATOMIC_RELAXED);
+
+  /* forget about progress nobody is waiting for anymore */
+  if(stage->done)
   {
-    if(pollinfo.revents != 0)
-    {
-      /* handle event */
-      switch(session->state)
-      {
-        case COMMAND_STATE:
-          if(pollinfo.revents & POLL_UNKNOWN)
-            console_print(YELLOW "cmd_fd: revents=0x%08X\n" RESET, pollinfo.revents);
-
-          /* we need to read a new command */
-          if(pollinfo.revents & (POLLERR|POLLHUP))
-            ftp_session_close_cmd(session);
-          else if(pollinfo.revents & POLLIN)
-            ftp_session_read_command(session);
-          break;
-
-        case DATA_CONNECT_STATE:
-          if(pollinfo.revents & POLL_UNKNOWN)
-            console_print(YELLOW "pasv_fd: revents=0x%08X\n" RESET, pollinfo.revents);
-
-          /* we need to accept the PASV connection */
-          if(pollinfo.revents & (POLLERR|POLLHUP))
-          {
-            ftp_session_set_state(session, COMMAND_STATE);
-            ftp_send_response(session, 426, "Data connection failed\r\n");
-          }
-          else if(pollinfo.revents & POLLIN)
-          {
-            if(ftp_session_accept(session) != 0)
-              ftp_session_set_state(session, COMMAND_STATE);
-          }
-          break;
-
-        case DATA_TRANSFER_STATE:
-          if(pollinfo.revents & POLL_UNKNOWN)
-            console_print(YELLOW "data_fd: revents=0x%08X\n" RESET, pollinfo.revents);
-
-          /* we need to transfer data */
-          if(pollinfo.revents & (POLLERR|POLLHUP))
-          {
-            ftp_session_set_state(session, COMMAND_STATE);
-            ftp_send_response(session, 426, "Data connection failed\r\n");
-          }
-          else if(pollinfo.revents & (POLLIN|POLLOUT))
-            ftp_session_transfer(session);
-          break;
-      }
-    }
+    for(link = &worker->disk_done; *link != stage; link = &(*link)->done_next)
+      ;
+    *link       = stage->done_next;
+    stage->done = 0;
   }
+  busy = stage->queued;
+  mutex_unlock(&worker->lock);
 
-  /* still connected to peer; return next session */
-  if(session->cmd_fd >= 0)
-    return session->next;
+  session->xfer_syscalls += __atomic_load_n(&stage->syscalls, __ATOMIC_RELAXED);
+  session->xfer_copied   += __atomic_load_n(&stage->copied, __ATOMIC_RELAXED);
 
-  /* disconnected from peer; destroy it and return next session */
-  return ftp_session_destroy(session);
+  if(busy)
+    return 0;
+  return ftp_worker_free_stage(worker, stage);
 }
 
-/*! initialize ftp subsystem */
-int
-ftp_init(void)
+/*! check whether the disk thread has more to do for a stage
+ *
+ *  @param[in] stage stage
+ *
+ *  @returns whether the ring has an empty buffer to read into (RETR) or a
+ *           full buffer to write out (STOR)
+ */
+static int
+ftp_stage_pending(ftp_stage_t *stage)
 {
-  int rc;
+  if(__atomic_load_n(&stage->cancel, __ATOMIC_RELAXED) || stage->error)
+    return 0;
 
-#ifdef _3DS
-  Result  ret;
+  if(stage->store)
+    return __atomic_load_n(&stage->head, __ATOMIC_ACQUIRE) != stage->tail;
 
-#if ENABLE_LOGGING
-  /* open log file */
-  FILE *fp = freopen("/ftbrony.log", "wb", stderr);
-  if(fp == NULL)
+  return !stage->eof
+      && stage->head - __atomic_load_n(&stage->tail, __ATOMIC_ACQUIRE) < STAGE_BUFFERS;
+}
+
+/*! write one buffer of a stage to its file
+ *
+ *  @param[in] stage stage
+ *
+ *  @note runs on the disk thread
+ */
+static void
+ftp_stage_write(ftp_stage_t *stage)
+{
+  ssize_t      rc;
+  size_t       pos  = 0;
+  unsigned int slot = stage->tail % STAGE_BUFFERS;
+
+  while(pos < stage->length[slot])
   {
-    console_print(RED "freopen: 0x%08X\n" RESET, errno);
-    goto stderr_fail;
+    rc = write(stage->fd, stage->buffer[slot] + pos, stage->length[slot] - pos);
+    __atomic_add_fetch(&stage->syscalls, 1, __ATOMIC_RELAXED);
+    if(rc <= 0)
+    {
+      if(rc < 0 && errno == EINTR)
+        continue;
+
+      if(rc < 0)
+        console_print(RED "write: %d %s\n" RESET, errno, strerror(errno));
+      else
+        console_print(RED "write: wrote 0 bytes\n" RESET);
+      __atomic_store_n(&stage->error, rc < 0 ? errno : EIO, __ATOMIC_RELEASE);
+      return;
+    }
+
+    pos += rc;
   }
 
-  /* truncate log file */
-  if(ftruncate(fileno(fp), 0) != 0)
+  __atomic_add_fetch(&stage->copied, pos, __ATOMIC_RELAXED);
+  __atomic_store_n(&stage->tail, stage->tail + 1, __ATOMIC_RELEASE);
+}
+
+/*! fill or write out one buffer of a stage
+ *
+ *  @param[in] stage stage
+ *
+ *  @note runs on the disk thread
+ */
+static void
+ftp_stage_step(ftp_stage_t *stage)
+{
+  ssize_t      rc;
+  unsigned int slot;
+
+  if(!ftp_stage_pending(stage))
+    return;
+
+  if(stage->store)
   {
-    console_print(RED "ftruncate: 0x%08X\n" RESET, errno);
-    goto ftruncate_fail;
+    ftp_stage_write(stage);
+    return;
   }
-#endif
 
-  /* allocate buffer for SOC service */
-  SOCU_buffer = (u32*)memalign(SOCU_ALIGN, SOCU_BUFFERSIZE);
-  if(SOCU_buffer == NULL)
+  slot = stage->head % STAGE_BUFFERS;
+
+  do
   {
-    console_print(RED "memalign: failed to allocate\n" RESET);
-    goto memalign_fail;
-  }
+    rc = read(stage->fd, stage->buffer[slot], XFER_BUFFERSIZE);
+    __atomic_add_fetch(&stage->syscalls, 1, __ATOMIC_RELAXED);
+  } while(rc < 0 && errno == EINTR);
 
-  /* initialize SOC service */
-  ret = socInit(SOCU_buffer, SOCU_BUFFERSIZE);
-  if(ret != 0)
+  if(rc < 0)
   {
-    console_print(RED "socInit: 0x%08X\n" RESET, (unsigned int)ret);
-    goto soc_fail;
+    console_print(RED "read: %d %s\n" RESET, errno, strerror(errno));
+    __atomic_store_n(&stage->error, errno, __ATOMIC_RELEASE);
   }
-#endif
-
-  /* allocate socket to listen for clients */
-  listenfd = socket(AF_INET, SOCK_STREAM, 0);
-  if(listenfd < 0)
+  else if(rc == 0)
+    __atomic_store_n(&stage->eof, 1, __ATOMIC_RELEASE);
+  else
   {
-    console_print(RED "socket: %d %s\n" RESET, errno, strerror(errno));
-    ftp_exit();
-    return -1;
+    __atomic_add_fetch(&stage->copied, rc, __ATOMIC_RELAXED);
+    stage->length[slot] = rc;
+    __atomic_store_n(&stage->head, stage->head + 1, __ATOMIC_RELEASE);
   }
+}
 
-  /* set socket options */
-  ftp_set_socket_options(listenfd);
-
-  /* get address to listen on */
+/*! disk thread entry point
+ *
+ *  @param[in] arg worker (ftp_worker_t*)
+ *
+ *  @note stages are served one buffer at a time, round-robin, so a slow
+ *        file doesn't hold up the others
+ */
+static void
+ftp_disk_thread(void *arg)
+{
+  ftp_worker_t *worker = (ftp_worker_t*)arg;
+  ftp_stage_t  *stage;
+  int          wake;
+  uint64_t     val = 1;
+
+  for(;;)
+  {
+    mutex_lock(&worker->lock);
+    stage = worker->disk_head;
+    if(stage != NULL)
+    {
+      worker->disk_head = stage->next;
+      if(worker->disk_head == NULL)
+        worker->disk_tail = NULL;
+    }
+    else if(worker->disk_quit)
+    {
+      mutex_unlock(&worker->lock);
+      break;
+    }
+    mutex_unlock(&worker->lock);
+
+    if(stage == NULL)
+    {
+      event_wait(&worker->disk_event);
+      continue;
+    }
+
+    ftp_stage_step(stage);
+
+    mutex_lock(&worker->lock);
+    if(ftp_stage_pending(stage))
+    {
+      /* go to the back of the queue */
+      stage->next = NULL;
+      if(worker->disk_tail != NULL)
+        worker->disk_tail->next = stage;
+      else
+        worker->disk_head = stage;
+      worker->disk_tail = stage;
+    }
+    else
+      __atomic_store_n(&stage->queued, 0, __ATOMIC_RELEASE);
+
+    /* tell the worker; an abandoned stage goes back to it to be freed */
+    wake = 0;
+    if(!stage->done && (stage->session != NULL || !stage->queued))
+    {
+      wake              = worker->disk_done == NULL;
+      stage->done       = 1;
+      stage->done_next  = worker->disk_done;
+      __atomic_store_n(&worker->disk_done, stage, __ATOMIC_RELAXED);
+    }
+    mutex_unlock(&worker->lock);
+
+    /* without wake_fd, the worker checks periodically */
+    if(wake && worker->wake_fd >= 0 && write(worker->wake_fd, &val, sizeof(val)) < 0)
+      console_print(RED "write: %d %s\n" RESET, errno, strerror(errno));
+  }
+}
+
+/*! close directory being listed for ftp session
+ *
+ *   @param[in] session ftp session
+ */
+static void
+ftp_session_close_dir(ftp_session_t *session)
+{
+  int rc;
+
+  /* close open directory pointer */
+  rc = closedir(session->dp);
+  if(rc != 0)
+    console_print(RED "closedir: %d %s\n" RESET, errno, strerror(errno));
+  session->dp = NULL;
+}
+
+/*! open directory to list for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @return -1 for failure
+ */
+static int
+ftp_session_open_dir(ftp_session_t *session)
+{
+  /* open directory to list */
+  session->dp = opendir(session->list_path);
+  if(session->dp == NULL)
+  {
+    console_print(RED "opendir '%s': %d %s\n" RESET, session->list_path, errno, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/*! drop cached listings of the directory containing a path
+ *
+ *  @param[in] path absolute path that was created, removed or changed
+ */
+static void
+ftp_invalidate_parent(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+
+  listcache_invalidate(&list_cache, path, slash > path ? slash - path : 1, 0);
+}
+
+/*! drop cached listings of a directory and everything below it
+ *
+ *  @param[in] path absolute path of a directory that was removed or renamed
+ */
+static void
+ftp_invalidate_tree(const char *path)
+{
+  listcache_invalidate(&list_cache, path, strlen(path), 1);
+}
+
+/*! get the cache key for the listing being sent
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns format plus anything else that changes the rendering
+ */
+static unsigned int
+ftp_session_list_key(ftp_session_t *session)
+{
+  return session->list_format | session->list_facts << 4;
+}
+
+/*! free a listing's read-ahead window
+ *
+ *  @param[in] prefetch window to free
+ */
+static void
+ftp_prefetch_free(ftp_prefetch_t *prefetch)
+{
+  if(prefetch->dir_fd >= 0 && close(prefetch->dir_fd) != 0)
+    console_print(RED "close: %d %s\n" RESET, errno, strerror(errno));
+  free(prefetch->path);
+  free(prefetch);
+}
+
+/*! move the claim index past entries which don't need a stat
+ *
+ *  @param[in] prefetch window
+ *
+ *  @note the worker lock must be held; keeping claim on an entry which is
+ *        not ready stops head from passing it, so no slot at or after claim
+ *        is reused while a stat thread may still look at it
+ */
+static void
+ftp_prefetch_skip(ftp_prefetch_t *prefetch)
+{
+  while(prefetch->claim != prefetch->tail
+     && !prefetch->entry[prefetch->claim % PREFETCH_ENTRIES].need)
+    ++prefetch->claim;
+}
+
+/*! fetch the attributes of a read-ahead entry
+ *
+ *  @param[in] prefetch window
+ *  @param[in] entry    entry to fetch
+ *
+ *  @note runs on a stat thread
+ */
+static void
+ftp_prefetch_stat(ftp_prefetch_t       *prefetch,
+                  ftp_prefetch_entry_t *entry)
+{
+  int rc;
+#ifdef _3DS
+  char path[4096 + sizeof(entry->name)];
+
+  if(strcmp(prefetch->path, "/") == 0)
+    sprintf(path, "/%s", entry->name);
+  else
+    sprintf(path, "%s/%s", prefetch->path, entry->name);
+  rc = lstat(path, &entry->st);
+#else
+  rc = fstatat(prefetch->dir_fd, entry->name, &entry->st, AT_SYMLINK_NOFOLLOW);
+#endif
+  __atomic_add_fetch(&prefetch->stats, 1, __ATOMIC_RELAXED);
+
+  if(rc != 0)
+  {
+    entry->error = errno;
+    console_print(RED "stat '%s': %d %s\n" RESET, entry->name, entry->error,
+                  strerror(entry->error));
+  }
+}
+
+/*! stat thread entry point
+ *
+ *  @param[in] arg worker (ftp_worker_t*)
+ *
+ *  @note the threads take entries one at a time from the listing at the
+ *        front of the queue, so a listing's entries are fetched
+ *        concurrently and roughly in the order they are sent
+ */
+static void
+ftp_stat_thread(void *arg)
+{
+  ftp_worker_t         *worker = (ftp_worker_t*)arg;
+  ftp_prefetch_t       *prefetch;
+  ftp_prefetch_entry_t *entry;
+  int                  more, wake, abandoned;
+  uint64_t             val = 1;
+
+  for(;;)
+  {
+    entry = NULL;
+
+    mutex_lock(&worker->lock);
+    prefetch = worker->stat_head;
+    if(prefetch == NULL)
+    {
+      int quit = worker->stat_quit;
+
+      mutex_unlock(&worker->lock);
+      if(quit)
+        break;
+
+      event_wait(&worker->stat_event);
+      continue;
+    }
+
+    if(prefetch->claim != prefetch->tail)
+    {
+      entry = &prefetch->entry[prefetch->claim++ % PREFETCH_ENTRIES];
+      ++prefetch->busy;
+      ftp_prefetch_skip(prefetch);
+    }
+
+    /* the listing leaves the queue once every entry is claimed */
+    if(prefetch->claim == prefetch->tail)
+    {
+      worker->stat_head = prefetch->next;
+      if(worker->stat_head == NULL)
+        worker->stat_tail = NULL;
+      prefetch->queued = 0;
+    }
+    more = worker->stat_head != NULL;
+    mutex_unlock(&worker->lock);
+
+    /* get another thread going on what is left */
+    if(more)
+      event_signal(&worker->stat_event);
+
+    if(entry == NULL)
+      continue;
+
+    ftp_prefetch_stat(prefetch, entry);
+
+    mutex_lock(&worker->lock);
+    --prefetch->busy;
+    abandoned = prefetch->session == NULL && prefetch->busy == 0;
+
+    /* wake the event loop if it is waiting for this entry; this has to be
+     * decided before the entry is marked ready, since a session on the run
+     * queue may go on without the wakeup and move head as soon as it is
+     */
+    wake = 0;
+    if(prefetch->waiting
+    && entry == &prefetch->entry[prefetch->head % PREFETCH_ENTRIES])
+    {
+      wake                = worker->stat_done == NULL;
+      __atomic_store_n(&prefetch->waiting, 0, __ATOMIC_RELAXED);
+      prefetch->done      = 1;
+      prefetch->done_next = worker->stat_done;
+      __atomic_store_n(&worker->stat_done, prefetch, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&entry->ready, 1, __ATOMIC_RELEASE);
+    mutex_unlock(&worker->lock);
+
+    if(abandoned)
+      ftp_prefetch_free(prefetch);
+
+    /* without wake_fd, the worker checks periodically */
+    if(wake && worker->wake_fd >= 0 && write(worker->wake_fd, &val, sizeof(val)) < 0)
+      console_print(RED "write: %d %s\n" RESET, errno, strerror(errno));
+  }
+
+  /* pass the quit on to the next thread */
+  event_signal(&worker->stat_event);
+}
+
+/*! read directory entries into the free slots of the read-ahead window
+ *  and hand the ones which need a stat to the stat threads
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_read_ahead(ftp_session_t *session)
+{
+  ftp_worker_t         *worker   = session->worker;
+  ftp_prefetch_t       *prefetch = session->prefetch;
+  ftp_prefetch_entry_t *entry;
+  struct dirent        *dent;
+  unsigned int         tail = prefetch->tail;
+  int                  wake = 0;
+
+  /* slots before head are no longer touched by the stat threads */
+  while(session->dp != NULL && tail - prefetch->head < PREFETCH_ENTRIES)
+  {
+    dent = readdir(session->dp);
+    if(dent == NULL)
+    {
+      /* the stat threads keep using the duplicate fd */
+      ftp_session_close_dir(session);
+      break;
+    }
+
+    if(strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+      continue;
+
+    entry = &prefetch->entry[tail++ % PREFETCH_ENTRIES];
+    strcpy(entry->name, dent->d_name);
+    entry->error = 0;
+    entry->need  = 1;
+#ifdef DT_DIR
+    /* see ftp_session_stat_entry */
+    if(!prefetch->full && dent->d_type == DT_DIR)
+    {
+      memset(&entry->st, 0, sizeof(entry->st));
+      entry->st.st_mode = S_IFDIR;
+      entry->need       = 0;
+    }
+#endif
+    __atomic_store_n(&entry->ready, !entry->need, __ATOMIC_RELAXED);
+  }
+
+  if(tail == prefetch->tail)
+    return;
+
+  mutex_lock(&worker->lock);
+  prefetch->tail = tail;
+  ftp_prefetch_skip(prefetch);
+  if(!prefetch->queued && prefetch->claim != tail)
+  {
+    prefetch->queued = 1;
+    prefetch->next   = NULL;
+    if(worker->stat_tail != NULL)
+      worker->stat_tail->next = prefetch;
+    else
+      worker->stat_head = prefetch;
+    worker->stat_tail = prefetch;
+    wake = 1;
+  }
+  mutex_unlock(&worker->lock);
+
+  if(wake)
+    event_signal(&worker->stat_event);
+}
+
+/*! set up a read-ahead window for the listing of ftp session
+ *
+ *  @param[in] session ftp session with session->dp open
+ *
+ *  @note without one, the listing stats its entries on the event loop
+ */
+static void
+ftp_session_get_prefetch(ftp_session_t *session)
+{
+  ftp_prefetch_t *prefetch;
+
+  if(session->worker->num_stat_threads == 0)
+    return;
+
+  prefetch = (ftp_prefetch_t*)malloc(sizeof(*prefetch));
+  if(prefetch == NULL)
+    return;
+
+  memset(prefetch, 0, sizeof(*prefetch));
+  prefetch->session = session;
+  prefetch->full    = session->list_facts & (FACT_MODIFY|FACT_PERM);
+  prefetch->path    = strdup(session->list_path);
+#ifdef _3DS
+  prefetch->dir_fd  = -1;
+#else
+  /* the directory is closed as soon as readdir() is done with it */
+  prefetch->dir_fd  = dup(dirfd(session->dp));
+  if(prefetch->dir_fd < 0)
+    console_print(RED "dup: %d %s\n" RESET, errno, strerror(errno));
+#endif
+  if(prefetch->path == NULL
+#ifndef _3DS
+  || prefetch->dir_fd < 0
+#endif
+  )
+  {
+    ftp_prefetch_free(prefetch);
+    return;
+  }
+
+  /* the stat threads can start while the data connection is set up */
+  session->prefetch = prefetch;
+  ftp_session_read_ahead(session);
+}
+
+/*! detach the read-ahead window from ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @note if stat threads are still using the window, the last one frees it
+ */
+static void
+ftp_session_put_prefetch(ftp_session_t *session)
+{
+  ftp_worker_t   *worker   = session->worker;
+  ftp_prefetch_t *prefetch = session->prefetch, *prev, **link;
+  uint64_t       stats;
+  int            busy;
+
+  if(prefetch == NULL)
+    return;
+  session->prefetch = NULL;
+
+  mutex_lock(&worker->lock);
+  prefetch->session = NULL;
+
+  /* nobody is waiting for it anymore */
+  if(prefetch->done)
+  {
+    for(link = &worker->stat_done; *link != prefetch; link = &(*link)->done_next)
+      ;
+    __atomic_store_n(link, prefetch->done_next, __ATOMIC_RELAXED);
+    prefetch->done = 0;
+  }
+
+  /* stop handing out its entries */
+  if(prefetch->queued)
+  {
+    prev = NULL;
+    for(link = &worker->stat_head; *link != prefetch; link = &(*link)->next)
+      prev = *link;
+    *link = prefetch->next;
+    if(worker->stat_tail == prefetch)
+      worker->stat_tail = prev;
+    prefetch->queued = 0;
+  }
+  busy  = prefetch->busy;
+  stats = __atomic_load_n(&prefetch->stats, __ATOMIC_RELAXED);
+  mutex_unlock(&worker->lock);
+
+  session->list_stats    += stats;
+  session->xfer_syscalls += stats;
+
+  if(busy == 0)
+    ftp_prefetch_free(prefetch);
+}
+
+/*! check whether every entry of the listing has been rendered
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns whether the listing is complete
+ */
+static int
+ftp_session_list_done(ftp_session_t *session)
+{
+  return session->dp == NULL
+      && (session->prefetch == NULL || session->prefetch->head == session->prefetch->tail);
+}
+
+/*! start copying the listing being read for the cache
+ *
+ *  @param[in] session ftp session
+ *
+ *  @note call before opening the directory, so changes made while it is
+ *        being read keep the copy out of the cache
+ */
+static void
+ftp_session_start_capture(ftp_session_t *session)
+{
+  if(list_cache.capacity == 0)
+    return;
+
+  session->flags        |= SESSION_CAPTURE;
+  session->capture_size  = 0;
+  session->capture_gen   = listcache_generation(&list_cache);
+}
+
+/*! copy the lines just rendered into session->buffer for the cache
+ *
+ *  @param[in] session ftp session
+ *
+ *  @note once the directory is closed the copy is handed to the cache
+ */
+static void
+ftp_session_capture(ftp_session_t *session)
+{
+  size_t need = session->capture_size + session->buffersize;
+  size_t max;
+  char   *capture;
+
+  if(!(session->flags & SESSION_CAPTURE))
+    return;
+
+  if(need > list_cache.capacity)
+  {
+    /* too big to be worth caching */
+    free(session->capture);
+    session->capture     = NULL;
+    session->capture_max = 0;
+    session->flags      &= ~SESSION_CAPTURE;
+    return;
+  }
+
+  if(need > session->capture_max)
+  {
+    max = session->capture_max ? session->capture_max*2 : XFER_BUFFERSIZE;
+    while(max < need)
+      max *= 2;
+
+    capture = (char*)realloc(session->capture, max);
+    if(capture == NULL)
+    {
+      free(session->capture);
+      session->capture     = NULL;
+      session->capture_max = 0;
+      session->flags      &= ~SESSION_CAPTURE;
+      return;
+    }
+
+    session->capture     = capture;
+    session->capture_max = max;
+  }
+
+  memcpy(session->capture + session->capture_size, session->buffer,
+         session->buffersize);
+  session->capture_size = need;
+
+  if(ftp_session_list_done(session))
+  {
+    /* the listing is complete; don't tie up unused capacity in the cache */
+    capture = session->capture;
+    if(session->capture_size == 0)
+    {
+      free(capture);
+      capture = NULL;
+    }
+    else if(session->capture_size < session->capture_max)
+    {
+      capture = (char*)realloc(capture, session->capture_size);
+      if(capture == NULL)
+        capture = session->capture;
+    }
+
+    listcache_insert(&list_cache, session->list_path, ftp_session_list_key(session),
+                     capture, session->capture_size, session->list_entries,
+                     session->capture_gen, ftp_time());
+    session->capture     = NULL;
+    session->capture_max = 0;
+    session->flags      &= ~SESSION_CAPTURE;
+  }
+}
+
+/*! release the listing state of an ftp session
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_put_listing(ftp_session_t *session)
+{
+  ftp_session_put_prefetch(session);
+
+  if(session->listing != NULL)
+    listcache_put(&list_cache, session->listing);
+  session->listing = NULL;
+
+  free(session->list_path);
+  session->list_path = NULL;
+
+  free(session->capture);
+  session->capture     = NULL;
+  session->capture_max = 0;
+  session->flags      &= ~SESSION_CAPTURE;
+}
+
+/*! forget the file being uploaded, dropping listings which show its old size
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_end_store(ftp_session_t *session)
+{
+  if(session->store_path == NULL)
+    return;
+
+  ftp_invalidate_parent(session->store_path);
+  free(session->store_path);
+  session->store_path = NULL;
+}
+
+/*! add to a worker metrics counter
+ *
+ *  @param[in] counter counter in the calling worker's ftp_metrics_t
+ *  @param[in] delta   amount to add (negative for gauges going down)
+ */
+static void
+ftp_metric_add(uint64_t *counter,
+               int64_t  delta)
+{
+  /* only the owner writes; readers just need to see whole values */
+  __atomic_store_n(counter, *counter + delta, __ATOMIC_RELAXED);
+}
+
+/*! count the data moved by ftp session
+ *
+ *  @param[in] session ftp session
+ *  @param[in] bytes   xfer_bytes before the data was moved
+ */
+static void
+ftp_session_count_bytes(ftp_session_t *session,
+                        uint64_t      bytes)
+{
+  ftp_metrics_t *metrics = &session->worker->metrics;
+
+  if(session->xfer_bytes == bytes)
+    return;
+
+  if(session->flags & SESSION_RECV)
+    ftp_metric_add(&metrics->bytes_received, session->xfer_bytes - bytes);
+  else
+    ftp_metric_add(&metrics->bytes_sent, session->xfer_bytes - bytes);
+}
+
+/*! record how long something took for ftp session
+ *
+ *  @param[in] session ftp session
+ *  @param[in] which   latency histogram (command slot or LATENCY_*)
+ *  @param[in] start   when it started (usec)
+ */
+static void
+ftp_session_record(ftp_session_t *session,
+                   unsigned int  which,
+                   uint64_t      start)
+{
+  histogram_record(&session->worker->latency[which], ftp_time() - start);
+}
+
+/*! add ftp session to the end of its worker's run queue
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_enqueue(ftp_session_t *session)
+{
+  ftp_worker_t *worker = session->worker;
+
+  if(session->runnable)
+    return;
+
+  session->runnable = 1;
+  session->run_next = NULL;
+  if(worker->run_tail != NULL)
+    worker->run_tail->run_next = session;
+  else
+    worker->run_head = session;
+  worker->run_tail = session;
+}
+
+/*! remove ftp session from its worker's run queue
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_dequeue(ftp_session_t *session)
+{
+  ftp_worker_t  *worker = session->worker;
+  ftp_session_t *prev   = NULL, *cur = worker->run_head;
+
+  if(!session->runnable)
+    return;
+
+  while(cur != session)
+  {
+    prev = cur;
+    cur  = cur->run_next;
+  }
+
+  if(prev != NULL)
+    prev->run_next = session->run_next;
+  else
+    worker->run_head = session->run_next;
+  if(worker->run_tail == session)
+    worker->run_tail = prev;
+  session->runnable = 0;
+}
+
+/*! set state for ftp session
+ *
+ *  @param[in] session ftp session
+ *  @param[in] state   state to set
+ */
+static void
+ftp_session_set_state(ftp_session_t   *session,
+                      session_state_t state)
+{
+  uint64_t elapsed, mib;
+
+  /* data connection setup and the first byte are timed from here */
+  if(state != COMMAND_STATE && session->state == COMMAND_STATE)
+  {
+    session->data_start = ftp_time();
+    session->flags     |= SESSION_XFER;
+    ftp_metric_add(&session->worker->metrics.xfer_started, 1);
+  }
+
+  if(state != session->state)
+  {
+    ftp_metric_add(&session->worker->metrics.sessions[session->state], -1);
+    ftp_metric_add(&session->worker->metrics.sessions[state], 1);
+  }
+
+  if(state == DATA_TRANSFER_STATE && session->state != DATA_TRANSFER_STATE)
+  {
+    /* start measuring the transfer */
+    session->xfer_start    = ftp_time();
+    session->xfer_bytes    = 0;
+    session->xfer_syscalls = 0;
+    session->xfer_copied   = 0;
+    session->deficit       = 0;
+
+    /* the data socket is connected, so start this round; a short transfer
+     * then has its 226 go out with the 150
+     */
+    ftp_session_enqueue(session);
+  }
+
+  if(state == COMMAND_STATE && session->state != COMMAND_STATE)
+  {
+    /* the transfer is over; the buffers go back to the pool */
+    ftp_session_put_stage(session);
+    ftp_session_put_buffer(session);
+
+    /* commands pipelined behind the transfer get their turn from the run
+     * queue; no event will report them since they were already read
+     */
+    if(memchr(session->cmd_buffer, '\n', session->cmd_size) != NULL)
+      ftp_session_enqueue(session);
+  }
+
+  if(state != DATA_TRANSFER_STATE && session->state == DATA_TRANSFER_STATE)
+  {
+    /* report throughput so fairness between sessions can be checked, and
+     * syscalls and user space copies per MiB so transfer paths can be compared
+     */
+    elapsed = ftp_time() - session->xfer_start;
+    mib     = (session->xfer_bytes + 0xFFFFF) >> 20;
+    console_print(CYAN "transferred %llu bytes in %llu ms (%llu KiB/s, "
+                  "%llu syscalls/MiB, %llu KiB copied/MiB)\n" RESET,
+                  (unsigned long long)session->xfer_bytes,
+                  (unsigned long long)elapsed/1000,
+                  (unsigned long long)(elapsed ? session->xfer_bytes*1000000/1024/elapsed : 0),
+                  (unsigned long long)(mib ? session->xfer_syscalls/mib : 0),
+                  (unsigned long long)(mib ? (session->xfer_copied >> 10)/mib : 0));
+  }
+
+  session->state = state;
+
+  switch(state)
+  {
+    case COMMAND_STATE:
+      /* a listing or upload which never got a data connection is over too */
+      if(session->dp != NULL)
+        ftp_session_close_dir(session);
+      ftp_session_put_listing(session);
+      ftp_session_end_store(session);
+
+      /* close pasv and data sockets */
+      if(session->pasv_fd >= 0)
+        ftp_session_close_pasv(session);
+      if(session->data_fd >= 0)
+        ftp_session_close_data(session);
+      break;
+
+    case DATA_CONNECT_STATE:
+      /* close data socket; we are listening for a new one */
+      if(session->data_fd >= 0)
+        ftp_session_close_data(session);
+      break;
+
+    case DATA_TRANSFER_STATE:
+      /* close pasv socket; we are connecting for a new one */
+      if(session->pasv_fd >= 0)
+        ftp_session_close_pasv(session);
+  }
+
+  /* wait on the sockets needed for the new state */
+  if(session->cmd_fd >= 0)
+    ftp_session_watch(session);
+}
+
+#if defined(FTP_USE_SENDFILE) || defined(FTP_USE_SPLICE)
+/*! get how much the transfer may move in one call
+ *
+ *  @param[in] session ftp session
+ *  @param[in] size    bytes the transfer would like to move
+ *
+ *  @returns bytes to move
+ */
+static size_t
+ftp_session_quantum(ftp_session_t *session,
+                    size_t        size)
+{
+  if(ftp_config.quantum == 0 || session->deficit <= 0 || size <= (size_t)session->deficit)
+    return size;
+  return session->deficit;
+}
+#endif
+
+/*! run one round of the data transfer for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @note deficit round-robin: each round grants ftp_config.quantum bytes;
+ *        a transfer which runs out is put at the end of the run queue so
+ *        every other session gets a turn first, and one which blocks
+ *        forfeits the rest of its quantum
+ */
+static void
+ftp_session_transfer(ftp_session_t *session)
+{
+  int      rc;
+  uint64_t bytes;
+
+  session->deficit += ftp_config.quantum;
+  do
+  {
+    bytes = session->xfer_bytes;
+    rc = session->transfer(session);
+    session->deficit -= session->xfer_bytes - bytes;
+
+    if(bytes == 0 && session->xfer_bytes != 0)
+      ftp_session_record(session, LATENCY_FIRST_BYTE, session->data_start);
+    ftp_session_count_bytes(session, bytes);
+  } while(rc == 0 && (ftp_config.quantum == 0 || session->deficit > 0));
+
+  if(rc == 0 && session->state == DATA_TRANSFER_STATE)
+    ftp_session_enqueue(session);
+  else
+    session->deficit = 0;
+}
+
+/*! queue reply bytes for ftp session's peer
+ *
+ *  @param[in] session ftp session
+ *  @param[in] data    bytes to send
+ *  @param[in] size    number of bytes
+ *
+ *  @returns size
+ *  @returns -1 if the bytes could not be queued
+ */
+static ssize_t
+ftp_session_queue_output(ftp_session_t *session,
+                         const char    *data,
+                         size_t        size)
+{
+  ftp_worker_t *worker = session->worker;
+  char         *buffer;
+  size_t       max;
+
+  if(session->cmd_fd < 0)
+    return -1;
+
+  /* reuse the space of what was already sent */
+  if(session->out_pos != 0)
+  {
+    session->out_size -= session->out_pos;
+    memmove(session->out_buffer, session->out_buffer + session->out_pos,
+            session->out_size);
+    session->out_pos = 0;
+  }
+
+  /* a reader which falls behind stops our reading commands, so this only
+   * grows past OUT_BUFFERSIZE by the replies of one command
+   */
+  if(session->out_size + size > session->out_max)
+  {
+    max = session->out_max ? session->out_max : OUT_BUFFERSIZE;
+    while(max < session->out_size + size)
+      max *= 2;
+
+    buffer = (char*)realloc(session->out_buffer, max);
+    if(buffer == NULL)
+    {
+      console_print(RED "failed to queue reply\n" RESET);
+      return -1;
+    }
+    session->out_buffer = buffer;
+    session->out_max    = max;
+  }
+
+  memcpy(session->out_buffer + session->out_size, data, size);
+  session->out_size += size;
+
+  /* flushed at the end of the round */
+  if(!session->flush_queued)
+  {
+    session->flush_queued = 1;
+    session->flush_next   = worker->flush_head;
+    worker->flush_head    = session;
+  }
+
+  return size;
+}
+
+__attribute__((format(printf,3,4)))
+/*! send ftp response to ftp session's peer
+ *
+ *  @param[in] session ftp session
+ *  @param[in] code    response code
+ *  @param[in] fmt     format string
+ *  @param[in] ...     format arguments
+ *
+ *  returns bytes send to peer
+ */
+static ssize_t
+ftp_send_response(ftp_session_t *session,
+                  int           code,
+                  const char    *fmt, ...)
+{
+  char    buffer[CMD_BUFFERSIZE];
+  ssize_t rc;
+  va_list ap;
+
+  /* print response code and message to buffer */
+  va_start(ap, fmt);
+  if(code == 211)
+    rc = sprintf(buffer, "%d- ", code);
+  else if(fmt[0] == '-')
+    rc = sprintf(buffer, "%d", code); /* multi-line reply */
+  else
+    rc = sprintf(buffer, "%d ", code);
+  rc += vsnprintf(buffer+rc, sizeof(buffer)-rc, fmt, ap);
+  va_end(ap);
+
+  if(rc >= sizeof(buffer))
+  {
+    /* couldn't fit message; just send code */
+    console_print(RED "%s: buffersize too small\n" RESET, __func__);
+    rc = sprintf(buffer, "%d\r\n", code);
+  }
+
+  /* measure how long the command waited for its first reply */
+  if(session->cmd_time != 0)
+  {
+    uint64_t latency = ftp_time() - session->cmd_time;
+
+    session->reply_time += latency;
+    if(latency > session->reply_max)
+      session->reply_max = latency;
+    ++session->num_replies;
+    session->cmd_time = 0;
+  }
+
+  /* the first final reply after a transfer started tells how it ended */
+  if((session->flags & SESSION_XFER) && code >= 200)
+  {
+    ftp_metrics_t *metrics = &session->worker->metrics;
+
+    session->flags &= ~SESSION_XFER;
+    if(code == 226)
+      ftp_metric_add(&metrics->xfer_completed, 1);
+    else if(code == 426)
+      ftp_metric_add(&metrics->xfer_aborted, 1);
+    else if(code == 451)
+      ftp_metric_add(&metrics->xfer_errors, 1);
+    else
+      ftp_metric_add(&metrics->xfer_failed, 1);
+  }
+
+  /* queue response; it goes out with the rest of this round's replies */
+  console_print(GREEN "%s" RESET, buffer);
+  return ftp_session_queue_output(session, buffer, rc);
+}
+
+/*! destroy ftp session
+ *
+ *  @param[in] session ftp session
+ */
+static ftp_session_t*
+ftp_session_destroy(ftp_session_t *session)
+{
+  ftp_worker_t  *worker = session->worker;
+  ftp_session_t *next   = session->next;
+
+  if(session->num_replies != 0)
+  {
+    console_print(CYAN "replied to %u commands, avg %llu us, max %llu us\n" RESET,
+                  session->num_replies,
+                  (unsigned long long)(session->reply_time/session->num_replies),
+                  (unsigned long long)session->reply_max);
+  }
+
+  /* stop waiting for another round of the transfer */
+  ftp_session_dequeue(session);
+
+  /* a transfer cut off with the session never got its final reply */
+  if(session->flags & SESSION_XFER)
+    ftp_metric_add(&worker->metrics.xfer_failed, 1);
+  ftp_metric_add(&worker->metrics.sessions[session->state], -1);
+
+  /* drop replies which were never sent */
+  if(session->flush_queued)
+  {
+    ftp_session_t **link = &worker->flush_head;
+
+    while(*link != session)
+      link = &(*link)->flush_next;
+    *link = session->flush_next;
+    session->flush_queued = 0;
+  }
+
+  /* close all sockets */
+  if(session->cmd_fd >= 0)
+    ftp_session_close_cmd(session);
+  if(session->pasv_fd >= 0)
+    ftp_session_close_pasv(session);
+  if(session->data_fd >= 0)
+    ftp_session_close_data(session);
+#ifdef FTP_USE_SPLICE
+  if(session->pipe_fd[0] >= 0)
+  {
+    close(session->pipe_fd[0]);
+    close(session->pipe_fd[1]);
+  }
+#endif
+
+  /* unlink from sessions list */
+  if(session->next)
+    session->next->prev = session->prev;
+  if(session == worker->sessions)
+    worker->sessions = session->next;
+  else
+  {
+    session->prev->next = session->next;
+    if(session == worker->sessions->prev)
+      worker->sessions->prev = session->prev;
+  }
+
+  /* deallocate */
+  if(session->dp != NULL)
+    ftp_session_close_dir(session);
+  ftp_session_put_listing(session);
+  ftp_session_end_store(session);
+  ftp_session_put_stage(session);
+  ftp_session_put_buffer(session);
+  free(session->out_buffer);
+  ftp_pool_put(&worker->session_pool, session);
+  __atomic_sub_fetch(&worker->num_sessions, 1, __ATOMIC_RELAXED);
+
+  return next;
+}
+
+/*! allocate new ftp session
+ *
+ *  @param[in] worker worker to serve the session
+ *  @param[in] new_fd accepted command connection
+ */
+static void
+ftp_session_new(ftp_worker_t *worker,
+                int          new_fd)
+{
+  ssize_t       rc;
+  watch_kind_t  kind;
+  ftp_session_t *session;
+  socklen_t     addrlen;
+
+  /* allocate a new session */
+  session = (ftp_session_t*)ftp_pool_get(&worker->session_pool);
+  if(session == NULL)
+  {
+    console_print(RED "failed to allocate session\n" RESET);
+    ftp_closesocket(new_fd, 1);
+    __atomic_sub_fetch(&worker->num_sessions, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  /* initialize session */
+  memset(session->cwd, 0, sizeof(session->cwd));
+  strcpy(session->cwd, "/");
+  session->peer_addr.sin_addr.s_addr = INADDR_ANY;
+  session->cmd_fd   = new_fd;
+  session->pasv_fd  = -1;
+  session->data_fd  = -1;
+#ifdef FTP_USE_SPLICE
+  session->pipe_fd[0] = -1;
+  session->pipe_fd[1] = -1;
+  session->pipe_size  = 0;
+#endif
+  session->flags    = 0;
+  session->state    = COMMAND_STATE;
+  ftp_metric_add(&worker->metrics.sessions[COMMAND_STATE], 1);
+  session->next     = NULL;
+  session->prev     = NULL;
+  session->worker   = worker;
+  session->transfer = NULL;
+  session->buffer      = NULL;
+  session->restart     = 0;
+  session->stage       = NULL;
+  session->file_fd     = -1;
+  session->dp          = NULL;
+  session->list_path   = NULL;
+  session->list_format = LIST_FORMAT;
+  session->list_facts  = 0;
+  session->mlst_facts  = FACT_ALL;
+  session->list_entries = 0;
+  session->list_stats   = 0;
+  session->prefetch    = NULL;
+  session->listing     = NULL;
+  session->capture     = NULL;
+  session->capture_size = 0;
+  session->capture_max  = 0;
+  session->capture_gen  = 0;
+  session->store_path  = NULL;
+  session->run_next    = NULL;
+  session->runnable    = 0;
+  session->deficit     = 0;
+  session->xfer_start  = 0;
+  session->data_start  = 0;
+  session->xfer_bytes  = 0;
+  session->cmd_time    = 0;
+  session->cmd_size    = 0;
+  session->out_buffer  = NULL;
+  session->out_pos     = 0;
+  session->out_size    = 0;
+  session->out_max     = 0;
+  session->flush_next  = NULL;
+  session->flush_queued = 0;
+  session->reply_time  = 0;
+  session->reply_max   = 0;
+  session->num_replies = 0;
+#ifdef FTP_USE_IO_URING
+  session->io_buffer  = -1;
+  session->io_pending = 0;
+  session->io_reply   = 0;
+  session->io_cancel  = 0;
+#endif
+  for(kind = WATCH_CMD; kind < NUM_WATCHES; ++kind)
+  {
+    session->watch[kind].session = session;
+    session->watch[kind].kind    = kind;
+    session->watch[kind].fd      = -1;
+    session->watch[kind].events  = 0;
+    session->watch[kind].slot    = -1;
+  }
+
+  /* link to the sessions list */
+  if(worker->sessions == NULL)
+  {
+    worker->sessions = session;
+    session->prev    = session;
+  }
+  else
+  {
+    worker->sessions->prev->next = session;
+    session->prev                = worker->sessions->prev;
+    worker->sessions->prev       = session;
+  }
+
+  /* copy socket address to pasv address */
+  addrlen = sizeof(session->pasv_addr);
+  rc = getsockname(new_fd, (struct sockaddr*)&session->pasv_addr, &addrlen);
+  if(rc != 0)
+  {
+    console_print(RED "getsockname: %d %s\n" RESET, errno, strerror(errno));
+    ftp_send_response(session, 451, "Failed to get connection info\r\n");
+    ftp_session_destroy(session);
+    return;
+  }
+
+  /* replies are queued and flushed when the socket is writable */
+  if(ftp_set_socket_nonblocking(new_fd) != 0)
+  {
+    ftp_session_destroy(session);
+    return;
+  }
+
+#ifndef _3DS
+  {
+    int yes = 1;
+
+    /* replies are already coalesced per round; Nagle would only hold a 226
+     * back until the peer acks the 150 before it
+     */
+    if(setsockopt(new_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)) != 0)
+      console_print(RED "setsockopt: %d %s\n" RESET, errno, strerror(errno));
+  }
+#endif
+
+  session->cmd_fd = new_fd;
+
+  /* queue initiator response */
+  rc = ftp_send_response(session, 200, "Hello!\r\n");
+  if(rc <= 0)
+  {
+    ftp_session_destroy(session);
+    return;
+  }
+
+  /* start waiting for commands */
+  ftp_session_watch(session);
+}
+
+/*! hand a new connection to a worker
+ *
+ *  @param[in] worker worker to serve the connection
+ *  @param[in] new_fd accepted command connection
+ */
+static void
+ftp_worker_handoff(ftp_worker_t *worker,
+                   int          new_fd)
+{
+  int      *pending;
+  uint64_t val = 1;
+
+  mutex_lock(&worker->lock);
+  if(worker->num_pending == worker->max_pending)
+  {
+    size_t max = worker->max_pending ? 2*worker->max_pending : 8;
+
+    pending = (int*)realloc(worker->pending, max*sizeof(*pending));
+    if(pending == NULL)
+    {
+      mutex_unlock(&worker->lock);
+      console_print(RED "failed to allocate session\n" RESET);
+      ftp_closesocket(new_fd, 1);
+      __atomic_sub_fetch(&worker->num_sessions, 1, __ATOMIC_RELAXED);
+      return;
+    }
+
+    worker->pending     = pending;
+    worker->max_pending = max;
+  }
+  worker->pending[worker->num_pending++] = new_fd;
+  mutex_unlock(&worker->lock);
+
+  /* wake up the worker; without wake_fd it checks periodically */
+  if(worker->wake_fd >= 0 && write(worker->wake_fd, &val, sizeof(val)) < 0)
+    console_print(RED "write: %d %s\n" RESET, errno, strerror(errno));
+}
+
+/*! start sessions handed to a worker
+ *
+ *  @param[in] worker worker
+ */
+static void
+ftp_worker_adopt(ftp_worker_t *worker)
+{
+  size_t   i, num_pending;
+  int      fds[MAX_EVENTS];
+  uint64_t val;
+
+  /* clear wakeup before looking at the queue so none are lost */
+  if(worker->wake_fd >= 0 && read(worker->wake_fd, &val, sizeof(val)) < 0
+  && errno != EWOULDBLOCK)
+    console_print(RED "read: %d %s\n" RESET, errno, strerror(errno));
+
+  do
+  {
+    mutex_lock(&worker->lock);
+    num_pending = worker->num_pending;
+    if(num_pending > MAX_EVENTS)
+      num_pending = MAX_EVENTS;
+    worker->num_pending -= num_pending;
+    memcpy(fds, worker->pending + worker->num_pending, num_pending*sizeof(*fds));
+    mutex_unlock(&worker->lock);
+
+    for(i = 0; i < num_pending; ++i)
+      ftp_session_new(worker, fds[i]);
+  } while(num_pending == MAX_EVENTS);
+}
+
+/*! resume transfers the disk and stat threads made progress on
+ *
+ *  @param[in] worker worker
+ *
+ *  @note stages abandoned while the disk thread was using them are freed here
+ */
+static void
+ftp_worker_collect(ftp_worker_t *worker)
+{
+  ftp_stage_t    *stage, *abandoned = NULL;
+  ftp_prefetch_t *prefetch;
+
+  /* the disk thread may put a stage back on the list as soon as it is off */
+  mutex_lock(&worker->lock);
+  for(stage = worker->disk_done; stage != NULL; stage = stage->done_next)
+  {
+    stage->done = 0;
+    if(stage->session == NULL)
+    {
+      /* not queued either, so the disk queue link is free */
+      stage->next = abandoned;
+      abandoned   = stage;
+    }
+    else if(stage->session->state == DATA_TRANSFER_STATE)
+      ftp_session_enqueue(stage->session);
+  }
+  __atomic_store_n(&worker->disk_done, NULL, __ATOMIC_RELAXED);
+
+  /* abandoned listings are taken off the list right away */
+  for(prefetch = worker->stat_done; prefetch != NULL; prefetch = prefetch->done_next)
+  {
+    prefetch->done = 0;
+    if(prefetch->session->state == DATA_TRANSFER_STATE)
+      ftp_session_enqueue(prefetch->session);
+  }
+  __atomic_store_n(&worker->stat_done, NULL, __ATOMIC_RELAXED);
+  mutex_unlock(&worker->lock);
+
+  while((stage = abandoned) != NULL)
+  {
+    abandoned = stage->next;
+    ftp_worker_free_stage(worker, stage);
+  }
+}
+
+/*! accept a new client and give it to the least-loaded worker
+ *
+ *  @param[in] listen_fd socket to accept connection from
+ *
+ *  @returns -1 if no connection was accepted
+ */
+static int
+ftp_accept(int listen_fd)
+{
+  int                new_fd;
+  unsigned int       i, load, min_load;
+  ftp_worker_t       *worker;
+  struct sockaddr_in addr;
+  socklen_t          addrlen = sizeof(addr);
+
+  /* accept connection */
+  new_fd = accept(listen_fd, (struct sockaddr*)&addr, &addrlen);
+  if(new_fd < 0)
+  {
+    if(errno != EWOULDBLOCK)
+      console_print(RED "accept: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  console_print(CYAN "accepted connection from %s:%u\n" RESET,
+                inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+  /* find the worker with the fewest sessions */
+  worker   = &workers[0];
+  min_load = __atomic_load_n(&worker->num_sessions, __ATOMIC_RELAXED);
+  for(i = 1; i < num_workers; ++i)
+  {
+    load = __atomic_load_n(&workers[i].num_sessions, __ATOMIC_RELAXED);
+    if(load < min_load)
+    {
+      worker   = &workers[i];
+      min_load = load;
+    }
+  }
+
+  /* count it now so back-to-back connections are spread out */
+  __atomic_add_fetch(&worker->num_sessions, 1, __ATOMIC_RELAXED);
+
+  /* the acceptor's own worker can start the session directly */
+  if(worker == &workers[0])
+    ftp_session_new(worker, new_fd);
+  else
+    ftp_worker_handoff(worker, new_fd);
+
+  return 0;
+}
+
+/*! accept PASV connection for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for failure
+ */
+static int
+ftp_session_accept(ftp_session_t *session)
+{
+  int                rc, new_fd;
+  struct sockaddr_in addr;
+  socklen_t          addrlen = sizeof(addr);
+
+  if(session->flags & SESSION_PASV)
+  {
+    /* clear PASV flag */
+    session->flags &= ~SESSION_PASV;
+
+    /* tell the peer that we're ready to accept the connection */
+    ftp_send_response(session, 150, "Ready\r\n");
+
+    /* accept connection from peer */
+    new_fd = accept(session->pasv_fd, (struct sockaddr*)&addr, &addrlen);
+    if(new_fd < 0)
+    {
+      console_print(RED "accept: %d %s\n" RESET, errno, strerror(errno));
+      ftp_session_set_state(session, COMMAND_STATE);
+      ftp_send_response(session, 425, "Failed to establish connection\r\n");
+      return -1;
+    }
+
+    rc = ftp_set_socket_nonblocking(new_fd);
+    if(rc != 0)
+    {
+      ftp_closesocket(new_fd, 1);
+      ftp_session_set_state(session, COMMAND_STATE);
+      ftp_send_response(session, 425, "Failed to establish connection\r\n");
+      return -1;
+    }
+
+    console_print(CYAN "accepted connection from %s:%u\n" RESET,
+                  inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+    session->data_fd = new_fd;
+    ftp_session_record(session, LATENCY_DATA_SETUP, session->data_start);
+    ftp_session_set_state(session, DATA_TRANSFER_STATE);
+
+    return 0;
+  }
+  else
+  {
+    /* peer didn't send PASV command */
+    ftp_send_response(session, 503, "Bad sequence of commands\r\n");
+    return -1;
+  }
+}
+
+/*! connect to peer for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for failure
+ */
+static int
+ftp_session_connect(ftp_session_t *session)
+{
+  int rc;
+
+  /* clear PORT flag */
+  session->flags &= ~SESSION_PORT;
+
+  /* create a new socket */
+  session->data_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(session->data_fd < 0)
+  {
+    console_print(RED "socket: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  /* set socket options */
+  ftp_set_socket_options(session->data_fd);
+
+  /* connect to peer */
+  rc = connect(session->data_fd, (struct sockaddr*)&session->peer_addr,
+               sizeof(session->peer_addr));
+  if(rc != 0)
+  {
+    console_print(RED "connect: %d %s\n" RESET, errno, strerror(errno));
+    ftp_closesocket(session->data_fd, 0);
+    session->data_fd = -1;
+    return -1;
+  }
+
+  rc = ftp_set_socket_nonblocking(session->data_fd);
+  if(rc != 0)
+    return -1;
+
+  console_print(CYAN "connected to %s:%u\n" RESET,
+                inet_ntoa(session->peer_addr.sin_addr),
+                ntohs(session->peer_addr.sin_port));
+
+  ftp_session_record(session, LATENCY_DATA_SETUP, session->data_start);
+
+  return 0;
+}
+
+/*! execute a command line for ftp session
+ *
+ *  @param[in] session ftp session
+ *  @param[in] line    command and arguments, without the line ending
+ */
+static void
+ftp_session_dispatch(ftp_session_t *session,
+                     char          *line)
+{
+  char                *args;
+  const ftp_command_t *command;
+  uint64_t            start;
+
+  /* split into command and arguments */
+  args = line;
+  while(*args && !isspace((int)*args))
+    ++args;
+  if(*args)
+    *args++ = 0;
+
+  /* look up the command */
+  command = ftp_command_find(line);
+
+  /* execute the command */
+  if(command == NULL)
+  {
+    ftp_send_response(session, 502, "invalid command -> %s %s\r\n",
+                      line, args);
+  }
+  else
+  {
+    /* clear RENAME flag for all commands except RNTO */
+    if(!(command->flags & CMD_RENAME))
+      session->flags &= ~SESSION_RENAME;
+
+    start = ftp_time();
+    command->handler(session, args);
+    ftp_session_record(session, command - ftp_commands, start);
+
+    /* a REST offset is used up by the next transfer */
+    if(command->flags & CMD_RESTART)
+      session->restart = 0;
+  }
+
+  /* idle sessions don't hold a buffer; RNFR keeps its path for RNTO */
+  if(session->state == COMMAND_STATE && !(session->flags & SESSION_RENAME))
+    ftp_session_put_buffer(session);
+}
+
+/*! execute the complete command lines received for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @note a command which starts a data transfer stops the loop; the lines
+ *        after it wait until the session is back in COMMAND_STATE
+ */
+static void
+ftp_session_run_commands(ftp_session_t *session)
+{
+  char   *line, *end;
+  size_t pos = 0;
+
+  /* stop while the peer isn't reading our replies */
+  while(session->state == COMMAND_STATE && session->cmd_fd >= 0
+     && session->out_size - session->out_pos < OUT_BUFFERSIZE)
+  {
+    line = session->cmd_buffer + pos;
+    end  = memchr(line, '\n', session->cmd_size - pos);
+    if(end == NULL)
+      break;
+    pos = end + 1 - session->cmd_buffer;
+
+    /* the end of a line which was too long was already refused */
+    if(session->flags & SESSION_SKIP)
+    {
+      session->flags &= ~SESSION_SKIP;
+      continue;
+    }
+
+    if(end > line && end[-1] == '\r')
+      --end;
+    *end = 0;
+    if(*line == 0)
+      continue;
+
+    /* the command was ready by the time this round started */
+    session->cmd_time = session->worker->wake_time;
+    ftp_session_dispatch(session, line);
+  }
+
+  /* keep a partial line for the next recv() */
+  session->cmd_size -= pos;
+  memmove(session->cmd_buffer, session->cmd_buffer + pos, session->cmd_size);
+}
+
+/*! read commands for ftp session
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_read_command(ftp_session_t *session)
+{
+  ssize_t rc;
+#ifdef FTP_USE_EPOLL
+  /* edge-triggered; keep reading until the socket is drained */
+  const int flags = MSG_DONTWAIT;
+#else
+  const int flags = 0;
+#endif
+
+  for(;;)
+  {
+    /* a line which fills the whole buffer is too long to be a command */
+    if(session->cmd_size == sizeof(session->cmd_buffer))
+    {
+      if(!(session->flags & SESSION_SKIP))
+        ftp_send_response(session, 500, "Command line too long\r\n");
+      session->flags   |= SESSION_SKIP;
+      session->cmd_size = 0;
+    }
+
+    /* retrieve commands */
+    rc = recv(session->cmd_fd, session->cmd_buffer + session->cmd_size,
+              sizeof(session->cmd_buffer) - session->cmd_size, flags);
+    if(rc < 0)
+    {
+      if(errno == EWOULDBLOCK)
+        return;
+
+      /* error retrieving command */
+      console_print(RED "recv: %d %s\n" RESET, errno, strerror(errno));
+      ftp_session_close_cmd(session);
+      return;
+    }
+    if(rc == 0)
+    {
+      /* peer closed connection */
+      ftp_session_close_cmd(session);
+      return;
+    }
+
+    /* execute every complete line, in order */
+    session->cmd_size += rc;
+    ftp_session_run_commands(session);
+
+    /* the rest is read once the session is back in COMMAND_STATE and the
+     * peer has caught up with our replies
+     */
+    if(session->state != COMMAND_STATE || session->cmd_fd < 0
+    || session->out_size - session->out_pos >= OUT_BUFFERSIZE)
+      return;
+
+#ifndef FTP_USE_EPOLL
+    /* level-triggered; the event engine reports anything left */
+    return;
+#endif
+  }
+}
+
+/*! handle socket events for ftp session
+ *
+ *  @param[in] session ftp session
+ *  @param[in] kind    which of the session's sockets is ready
+ *  @param[in] revents returned poll events
+ */
+static void
+ftp_session_event(ftp_session_t *session,
+                  watch_kind_t  kind,
+                  int           revents)
+{
+  if(kind == WATCH_CMD)
+  {
+    if(revents & POLL_UNKNOWN)
+      console_print(YELLOW "cmd_fd: revents=0x%08X\n" RESET, revents);
+
+    if(revents & (POLLERR|POLLHUP))
+      ftp_session_close_cmd(session);
+    else
+    {
+      /* the peer made room for the rest of our replies */
+      if((revents & POLLOUT) && ftp_session_flush(session) != 0)
+        ftp_session_close_cmd(session);
+
+      /* we need to read a new command */
+      if(session->cmd_fd >= 0 && session->state == COMMAND_STATE)
+      {
+        if(revents & POLLIN)
+          ftp_session_read_command(session);
+        else if(revents & POLLOUT)
+          ftp_session_run_commands(session);
+      }
+    }
+  }
+  else switch(session->state)
+  {
+    case COMMAND_STATE:
+      break;
+
+    case DATA_CONNECT_STATE:
+      if(revents & POLL_UNKNOWN)
+        console_print(YELLOW "pasv_fd: revents=0x%08X\n" RESET, revents);
+
+      /* we need to accept the PASV connection */
+      if(revents & (POLLERR|POLLHUP))
+      {
+        ftp_session_set_state(session, COMMAND_STATE);
+        ftp_send_response(session, 426, "Data connection failed\r\n");
+      }
+      else if(revents & POLLIN)
+      {
+        if(ftp_session_accept(session) != 0)
+          ftp_session_set_state(session, COMMAND_STATE);
+      }
+      break;
+
+    case DATA_TRANSFER_STATE:
+      if(revents & POLL_UNKNOWN)
+        console_print(YELLOW "data_fd: revents=0x%08X\n" RESET, revents);
+
+      /* we need to transfer data */
+      if(revents & (POLLERR|POLLHUP))
+      {
+        ftp_session_set_state(session, COMMAND_STATE);
+        ftp_send_response(session, 426, "Data connection failed\r\n");
+      }
+      else if((revents & (POLLIN|POLLOUT)) && !session->runnable)
+      {
+        /* a queued transfer gets its round from the run queue */
+        ftp_session_transfer(session);
+      }
+      break;
+  }
+
+  /* the handler may have opened or closed sockets */
+  if(session->cmd_fd >= 0)
+    ftp_session_watch(session);
+}
+
+#ifdef FTP_USE_IO_URING
+/*! take an io_uring transfer buffer for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 if the worker has no ring or no free buffer
+ */
+static int
+ftp_session_get_io_buffer(ftp_session_t *session)
+{
+  ftp_worker_t *worker = session->worker;
+
+  if(worker->ring.fd < 0 || worker->num_free_buffers == 0)
+    return -1;
+
+  session->io_buffer  = worker->free_buffers[--worker->num_free_buffers];
+  session->io_pending = 0;
+  session->io_reply   = 0;
+  session->io_cancel  = 0;
+  return 0;
+}
+
+/*! give back io_uring transfer buffer for ftp session
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_put_io_buffer(ftp_session_t *session)
+{
+  ftp_worker_t *worker = session->worker;
+
+  worker->free_buffers[worker->num_free_buffers++] = session->io_buffer;
+  session->io_buffer = -1;
+}
+
+/*! get a submission queue entry from a worker's ring
+ *
+ *  @param[in] worker worker
+ *
+ *  @returns NULL for error
+ */
+static struct io_uring_sqe*
+ftp_worker_get_sqe(ftp_worker_t *worker)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = uring_get_sqe(&worker->ring);
+  if(sqe == NULL)
+  {
+    /* submission queue is full; hand it to the kernel and retry */
+    if(uring_submit(&worker->ring, 0) >= 0)
+      sqe = uring_get_sqe(&worker->ring);
+  }
+
+  return sqe;
+}
+
+/*! queue an io_uring read or write for ftp session
+ *
+ *  @param[in] session ftp session
+ *  @param[in] op      whether to transfer to/from the file or the data socket
+ *  @param[in] write   write from the transfer buffer instead of reading into it
+ *  @param[in] pos     offset into the transfer buffer
+ *  @param[in] size    bytes to transfer
+ *  @param[in] flags   submission flags (IOSQE_IO_LINK to run the next request after this one)
+ *
+ *  @returns -1 for error
+ */
+static int
+ftp_session_queue_io(ftp_session_t *session,
+                     uring_op_t    op,
+                     int           write,
+                     size_t        pos,
+                     size_t        size,
+                     int           flags)
+{
+  ftp_worker_t        *worker = session->worker;
+  struct io_uring_sqe *sqe;
+
+  sqe = ftp_worker_get_sqe(worker);
+  if(sqe == NULL)
+    return -1;
+
+  if(worker->ring_fixed)
+  {
+    sqe->opcode    = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->buf_index = session->io_buffer;
+  }
+  else
+    sqe->opcode    = write ? IORING_OP_WRITE : IORING_OP_READ;
+
+  sqe->flags     = flags;
+  sqe->addr      = (uintptr_t)(worker->ring_buffers
+                               + (size_t)session->io_buffer*URING_BUFFERSIZE + pos);
+  sqe->len       = size;
+  sqe->user_data = (uintptr_t)session | op;
+
+  if(op == URING_FILE)
+  {
+    sqe->fd  = session->file_fd;
+    sqe->off = session->filepos;
+  }
+  else
+    sqe->fd  = session->data_fd;
+
+  ++session->io_pending;
+  return 0;
+}
+
+/*! queue the next round of io_uring requests for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for error
+ */
+static int
+ftp_session_next_io(ftp_session_t *session)
+{
+  /* finish writing out a partially written buffer */
+  if(session->bufferpos < session->buffersize)
+  {
+    return ftp_session_queue_io(session,
+                                (session->flags & SESSION_SEND) ? URING_DATA : URING_FILE,
+                                1, session->bufferpos,
+                                session->buffersize - session->bufferpos, 0);
+  }
+
+  /* receive the next chunk from the peer; its length isn't known until
+   * recv completes, so the file write is queued from the completion
+   */
+  if(session->flags & SESSION_RECV)
+    return ftp_session_queue_io(session, URING_DATA, 0, 0, URING_BUFFERSIZE, 0);
+
+  /* read the next chunk of the file and send it in one submission; a short
+   * read at the end of the file cancels the linked send
+   */
+  if(ftp_session_queue_io(session, URING_FILE, 0, 0, URING_BUFFERSIZE, IOSQE_IO_LINK) != 0)
+    return -1;
+  return ftp_session_queue_io(session, URING_DATA, 1, 0, URING_BUFFERSIZE, 0);
+}
+
+/*! end io_uring transfer for ftp session
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_end_io(ftp_session_t *session)
+{
+  int send = session->flags & SESSION_SEND;
+  int code = session->io_reply;
+
+  ftp_session_put_io_buffer(session);
+  ftp_session_close_file(session);
+
+  /* the session is being torn down */
+  if(session->cmd_fd < 0)
+  {
+    session->worker->reap_sessions = 1;
+    return;
+  }
+
+  ftp_session_set_state(session, COMMAND_STATE);
+  if(code == 0)
+    ftp_send_response(session, 226, "OK\r\n");
+  else if(code == 451)
+    ftp_send_response(session, 451, send ? "Failed to read file\r\n"
+                                         : "Failed to write file\r\n");
+  else
+    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
+}
+
+/*! start io_uring transfer for ftp session
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_start_io(ftp_session_t *session)
+{
+  /* the ring buffer replaces the session's buffer */
+  ftp_session_put_buffer(session);
+
+  session->bufferpos  = 0;
+  session->buffersize = 0;
+
+  if(ftp_session_next_io(session) != 0)
+  {
+    session->io_reply = 451;
+    if(session->io_pending == 0)
+      ftp_session_end_io(session);
+  }
+}
+
+/*! handle completion of an io_uring request for ftp session
+ *
+ *  @param[in] session ftp session
+ *  @param[in] op      which request completed
+ *  @param[in] res     request result
+ */
+static void
+ftp_session_complete_io(ftp_session_t *session,
+                        uring_op_t    op,
+                        int           res)
+{
+  int      reading = (op == URING_FILE) == ((session->flags & SESSION_SEND) != 0);
+  uint64_t bytes   = session->xfer_bytes;
+
+  --session->io_pending;
+
+  if(res == -ECANCELED)
+  {
+    /* a short read broke the chain, or the session was torn down */
+  }
+  else if(res < 0 || (!reading && res == 0))
+  {
+    if(res < 0)
+      console_print(RED "%s: %d %s\n" RESET, reading ? "read" : "write",
+                    -res, strerror(-res));
+    else
+      console_print(RED "write: wrote 0 bytes\n" RESET);
+
+    if(session->io_reply == 0)
+      session->io_reply = (op == URING_FILE) ? 451 : 426;
+  }
+  else if(reading)
+  {
+    /* a read of 0 bytes marks the end of the transfer */
+    session->bufferpos  = 0;
+    session->buffersize = res;
+    if(op == URING_FILE)
+      session->filepos += res;
+    else
+      session->xfer_bytes += res;
+  }
+  else
+  {
+    session->bufferpos += res;
+    if(op == URING_FILE)
+      session->filepos += res;
+    else
+      session->xfer_bytes += res;
+  }
+
+  if(bytes == 0 && session->xfer_bytes != 0)
+    ftp_session_record(session, LATENCY_FIRST_BYTE, session->data_start);
+  ftp_session_count_bytes(session, bytes);
+
+  if(session->io_pending > 0)
+    return;
+
+  if(session->io_reply == 0 && !session->io_cancel && session->cmd_fd >= 0)
+  {
+    if(session->buffersize == 0)
+    {
+      /* reached end of file or peer closed the connection */
+      ftp_session_end_io(session);
+      return;
+    }
+
+    /* after a read, write the buffer out; after a write, read the next chunk */
+    if(session->bufferpos == session->buffersize)
+      session->bufferpos = session->buffersize = 0;
+    if(ftp_session_next_io(session) == 0)
+      return;
+
+    session->io_reply = 451;
+    if(session->io_pending > 0)
+      return;
+  }
+
+  ftp_session_end_io(session);
+}
+
+/*! cancel in-flight io_uring requests for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @note the session must be kept until the cancelled requests complete
+ */
+static void
+ftp_session_cancel_io(ftp_session_t *session)
+{
+  struct io_uring_sqe *sqe;
+  uring_op_t          op;
+
+  if(session->io_cancel)
+    return;
+  session->io_cancel = 1;
+
+  /* there is at most one request of each kind in flight */
+  for(op = URING_FILE; op <= URING_DATA; ++op)
+  {
+    sqe = ftp_worker_get_sqe(session->worker);
+    if(sqe == NULL)
+      return;
+
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->addr      = (uintptr_t)session | op;
+    sqe->user_data = 0;
+  }
+}
+
+/*! handle io_uring completions for a worker
+ *
+ *  @param[in] worker worker
+ */
+static void
+ftp_worker_reap_ring(ftp_worker_t *worker)
+{
+  struct io_uring_cqe *cqe;
+  uint64_t            data, val;
+  int                 res;
+
+  /* reset the eventfd before looking at the queue so no completion is missed */
+  if(read(worker->ring_event_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+    console_print(RED "read: %d %s\n" RESET, errno, strerror(errno));
+
+  while((cqe = uring_peek_cqe(&worker->ring)) != NULL)
+  {
+    data = cqe->user_data;
+    res  = cqe->res;
+    uring_cqe_seen(&worker->ring);
+
+    /* cancellation requests have no session */
+    if(data != 0)
+      ftp_session_complete_io((ftp_session_t*)(uintptr_t)(data & ~(uint64_t)URING_MASK),
+                              (uring_op_t)(data & URING_MASK), res);
+  }
+}
+#endif
+
+/*! destroy sessions which lost their command connection
+ *
+ *  @param[in] worker worker owning the sessions
+ */
+static void
+ftp_reap_sessions(ftp_worker_t *worker)
+{
+  ftp_session_t *session;
+
+  worker->reap_sessions = 0;
+
+  session = worker->sessions;
+  while(session != NULL)
+  {
+    if(session->cmd_fd >= 0)
+      session = session->next;
+#ifdef FTP_USE_IO_URING
+    else if(session->io_pending > 0)
+    {
+      /* the kernel still owns the transfer buffer */
+      ftp_session_cancel_io(session);
+      session = session->next;
+    }
+#endif
+    else
+      session = ftp_session_destroy(session);
+  }
+}
+
+/*! run one round of every queued transfer
+ *
+ *  @param[in] worker worker owning the run queue
+ */
+static void
+ftp_worker_run(ftp_worker_t *worker)
+{
+  ftp_session_t *session, *last = worker->run_tail;
+
+  /* transfers which run out again are queued behind last */
+  while((session = worker->run_head) != NULL)
+  {
+    worker->run_head = session->run_next;
+    if(worker->run_head == NULL)
+      worker->run_tail = NULL;
+    session->runnable = 0;
+
+    if(session->cmd_fd >= 0 && session->state == DATA_TRANSFER_STATE)
+    {
+      ftp_session_transfer(session);
+      if(session->cmd_fd >= 0)
+        ftp_session_watch(session);
+    }
+    else if(session->cmd_fd >= 0 && session->state == COMMAND_STATE)
+    {
+      /* a transfer finished with more commands already received */
+      ftp_session_run_commands(session);
+      if(session->cmd_fd >= 0)
+        ftp_session_watch(session);
+    }
+
+    if(session == last)
+      break;
+  }
+}
+
+/*! render the metrics page
+ *
+ *  @param[out] buffer buffer to render into
+ *  @param[in]  size   size of buffer
+ *
+ *  @returns length of the page
+ *
+ *  @note every worker's counters are summed without stopping any of them
+ */
+static int
+ftp_metrics_render(char   *buffer,
+                   size_t size)
+{
+  static const char *states[NUM_SESSION_STATES] =
+  {
+    "command", "data_connect", "data_transfer",
+  };
+  ftp_metrics_t sum;
+  uint64_t      *in, *out;
+  unsigned int  i, j;
+  int           len = 0;
+
+  /* the struct is nothing but counters */
+  memset(&sum, 0, sizeof(sum));
+  for(i = 0; i < num_workers; ++i)
+  {
+    in  = (uint64_t*)&workers[i].metrics;
+    out = (uint64_t*)&sum;
+    for(j = 0; j < sizeof(sum)/sizeof(uint64_t); ++j)
+      out[j] += __atomic_load_n(&in[j], __ATOMIC_RELAXED);
+  }
+
+  len += snprintf(buffer + len, size - len,
+                  "# HELP ftpd_sessions Sessions by state.\n"
+                  "# TYPE ftpd_sessions gauge\n");
+  for(i = 0; i < NUM_SESSION_STATES; ++i)
+    len += snprintf(buffer + len, size - len, "ftpd_sessions{state=\"%s\"} %llu\n",
+                    states[i], (unsigned long long)sum.sessions[i]);
+
+  len += snprintf(buffer + len, size - len,
+                  "# HELP ftpd_data_sent_bytes_total Bytes sent on data connections.\n"
+                  "# TYPE ftpd_data_sent_bytes_total counter\n"
+                  "ftpd_data_sent_bytes_total %llu\n"
+                  "# HELP ftpd_data_received_bytes_total Bytes received on data connections.\n"
+                  "# TYPE ftpd_data_received_bytes_total counter\n"
+                  "ftpd_data_received_bytes_total %llu\n"
+                  "# HELP ftpd_transfers_started_total Transfer commands which asked for a data connection.\n"
+                  "# TYPE ftpd_transfers_started_total counter\n"
+                  "ftpd_transfers_started_total %llu\n"
+                  "# HELP ftpd_transfers_completed_total Transfers which ended with 226.\n"
+                  "# TYPE ftpd_transfers_completed_total counter\n"
+                  "ftpd_transfers_completed_total %llu\n"
+                  "# HELP ftpd_transfers_failed_total Transfers which ended with another reply, or none.\n"
+                  "# TYPE ftpd_transfers_failed_total counter\n"
+                  "ftpd_transfers_failed_total{reply=\"426\"} %llu\n"
+                  "ftpd_transfers_failed_total{reply=\"451\"} %llu\n"
+                  "ftpd_transfers_failed_total{reply=\"other\"} %llu\n"
+                  "# HELP ftpd_list_entries_total Directory entries sent in listings.\n"
+                  "# TYPE ftpd_list_entries_total counter\n"
+                  "ftpd_list_entries_total %llu\n"
+                  "# HELP ftpd_loop_iterations_total Rounds of the worker event loops.\n"
+                  "# TYPE ftpd_loop_iterations_total counter\n"
+                  "ftpd_loop_iterations_total %llu\n",
+                  (unsigned long long)sum.bytes_sent,
+                  (unsigned long long)sum.bytes_received,
+                  (unsigned long long)sum.xfer_started,
+                  (unsigned long long)sum.xfer_completed,
+                  (unsigned long long)sum.xfer_aborted,
+                  (unsigned long long)sum.xfer_errors,
+                  (unsigned long long)sum.xfer_failed,
+                  (unsigned long long)sum.list_entries,
+                  (unsigned long long)sum.loop_iterations);
+
+  return len;
+}
+
+/*! stop serving a metrics request
+ *
+ *  @param[in] scrape metrics request
+ */
+static void
+ftp_scrape_close(ftp_scrape_t *scrape)
+{
+  int fd = scrape->watch.fd;
+
+  /* the request has been read, so a plain close sends no reset; it also
+   * keeps periodic scrapes out of the console */
+  ftp_watch_set(&workers[0], &scrape->watch, -1, 0);
+  ftp_closesocket(fd, 0);
+  scrape->size = 0;
+}
+
+/*! answer a metrics request
+ *
+ *  @param[in] scrape metrics request
+ */
+static void
+ftp_scrape_respond(ftp_scrape_t *scrape)
+{
+  char    body[4096], response[4096 + 128];
+  int     body_len, len;
+  ssize_t rc;
+
+  if(strncmp(scrape->request, "GET ", 4) == 0)
+  {
+    body_len = ftp_metrics_render(body, sizeof(body));
+    len      = sprintf(response, "HTTP/1.0 200 OK\r\n"
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: %d\r\n\r\n", body_len);
+    memcpy(response + len, body, body_len);
+    len += body_len;
+  }
+  else
+  {
+    len = sprintf(response, "HTTP/1.0 405 Method Not Allowed\r\n"
+                            "Content-Length: 0\r\n\r\n");
+  }
+
+  /* a few KiB always fit in a new connection's send buffer */
+  rc = send(scrape->watch.fd, response, len, 0);
+  if(rc < 0)
+    console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
+  else if(rc != len)
+    console_print(RED "only sent %u/%u bytes of metrics\n" RESET,
+                  (unsigned int)rc, (unsigned int)len);
+
+  ftp_scrape_close(scrape);
+}
+
+/*! handle socket events for a metrics request
+ *
+ *  @param[in] scrape  metrics request
+ *  @param[in] revents returned poll events
+ */
+static void
+ftp_scrape_event(ftp_scrape_t *scrape,
+                 int          revents)
+{
+  ssize_t rc;
+
+  if(revents & POLLERR)
+  {
+    ftp_scrape_close(scrape);
+    return;
+  }
+
+  /* a hangup shows up as the end of the request */
+  for(;;)
+  {
+    rc = recv(scrape->watch.fd, scrape->request + scrape->size,
+              sizeof(scrape->request) - scrape->size - 1, 0);
+    if(rc < 0 && errno == EWOULDBLOCK)
+      return;
+    if(rc <= 0)
+    {
+      ftp_scrape_close(scrape);
+      return;
+    }
+
+    /* answer once the header is complete; nothing after it matters */
+    scrape->size += rc;
+    scrape->request[scrape->size] = 0;
+    if(strstr(scrape->request, "\r\n\r\n") != NULL
+    || strstr(scrape->request, "\n\n") != NULL
+    || scrape->size == sizeof(scrape->request) - 1)
+    {
+      ftp_scrape_respond(scrape);
+      return;
+    }
+  }
+}
+
+/*! accept a connection on the metrics socket
+ *
+ *  @returns -1 when there are no more connections to accept
+ */
+static int
+ftp_metrics_accept(void)
+{
+  int          new_fd;
+  unsigned int i;
+
+  new_fd = accept(metricsfd, NULL, NULL);
+  if(new_fd < 0)
+  {
+    if(errno != EWOULDBLOCK)
+      console_print(RED "accept: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  for(i = 0; i < MAX_SCRAPES; ++i)
+  {
+    if(scrapes[i].watch.fd < 0)
+      break;
+  }
+
+  /* never let scrapes tie up more than a few descriptors */
+  if(i == MAX_SCRAPES || ftp_set_socket_nonblocking(new_fd) != 0)
+  {
+    ftp_closesocket(new_fd, 0);
+    return 0;
+  }
+
+  /* the request is read when it arrives */
+  scrapes[i].size = 0;
+  ftp_watch_set(&workers[0], &scrapes[i].watch, new_fd, POLLIN);
+  if(scrapes[i].watch.fd != new_fd)
+    ftp_closesocket(new_fd, 1);
+
+  return 0;
+}
+
+/*! send the replies queued by each session this round
+ *
+ *  @param[in] worker worker
+ */
+static void
+ftp_worker_flush(ftp_worker_t *worker)
+{
+  ftp_session_t *session;
+
+  while((session = worker->flush_head) != NULL)
+  {
+    worker->flush_head    = session->flush_next;
+    session->flush_next   = NULL;
+    session->flush_queued  = 0;
+
+    if(session->cmd_fd < 0)
+      continue;
+
+    /* one send() for everything the round produced */
+    if(ftp_session_flush(session) != 0)
+    {
+      ftp_session_close_cmd(session);
+      continue;
+    }
+
+    /* commands held back while the peer wasn't reading can run again */
+    if(session->state == COMMAND_STATE
+    && session->out_size - session->out_pos < OUT_BUFFERSIZE
+    && memchr(session->cmd_buffer, '\n', session->cmd_size) != NULL)
+      ftp_session_enqueue(session);
+
+    /* wait for room for whatever is left */
+    ftp_session_watch(session);
+  }
+}
+
+/*! wait for and dispatch one round of events for a worker
+ *
+ *  @param[in] worker  worker
+ *  @param[in] timeout poll timeout in milliseconds
+ *
+ *  @returns -1 for error
+ */
+static int
+ftp_worker_loop(ftp_worker_t *worker,
+                int          timeout)
+{
+  int         rc, i;
+  ftp_watch_t *watch;
+  ftp_event_t *ready_events;
+
+  /* wait for a socket to be ready; don't sleep if transfers are queued */
+  rc = ftp_watch_wait(worker, worker->run_head != NULL ? 0 : timeout);
+  if(rc < 0)
+    return -1;
+  worker->wake_time = ftp_time();
+  ftp_metric_add(&worker->metrics.loop_iterations, 1);
+
+  ready_events = worker->ready_events;
+  for(i = 0; i < rc; ++i)
+  {
+    watch = ready_events[i].watch;
+
+    if(watch == &listen_watch)
+    {
+      /* accept all pending connections */
+      if(ready_events[i].revents & POLLIN)
+      {
+#ifdef FTP_USE_EPOLL
+        while(ftp_accept(listenfd) == 0)
+          ;
+#else
+        ftp_accept(listenfd);
+#endif
+      }
+      else
+      {
+        console_print(YELLOW "listenfd: revents=0x%08X\n" RESET,
+                      ready_events[i].revents);
+      }
+    }
+    else if(watch == &worker->wake_watch)
+    {
+      /* the acceptor handed us new connections, or the disk or stat
+       * threads made progress */
+      ftp_worker_adopt(worker);
+      ftp_worker_collect(worker);
+    }
+#ifdef FTP_USE_IO_URING
+    else if(watch == &worker->ring_watch)
+    {
+      /* transfers made progress */
+      ftp_worker_reap_ring(worker);
+    }
+#endif
+    else if(watch == &metrics_watch)
+    {
+      /* accept all pending metrics requests */
+      if(ready_events[i].revents & POLLIN)
+      {
+#ifdef FTP_USE_EPOLL
+        while(ftp_metrics_accept() == 0)
+          ;
+#else
+        ftp_metrics_accept();
+#endif
+      }
+    }
+    else if(watch->session == NULL)
+    {
+      /* the only other watches without a session are metrics requests */
+      if(watch->fd == ready_events[i].fd)
+        ftp_scrape_event((ftp_scrape_t*)watch, ready_events[i].revents);
+    }
+    else if(watch->session->cmd_fd >= 0
+         && watch->fd == ready_events[i].fd
+         && ftp_session_wants(watch->session, watch->kind) != 0)
+    {
+      /* dispatch to the handler for the session's state */
+      ftp_session_event(watch->session, watch->kind, ready_events[i].revents);
+    }
+  }
+
+  /* without wake_fd, check for disk and stat progress every round */
+  if(worker->wake_fd < 0
+  && (__atomic_load_n(&worker->disk_done, __ATOMIC_RELAXED) != NULL
+   || __atomic_load_n(&worker->stat_done, __ATOMIC_RELAXED) != NULL))
+    ftp_worker_collect(worker);
+
+  /* give each transfer which used up its quantum another round */
+  ftp_worker_run(worker);
+
+  /* without wake_fd, check for handoffs every round */
+  if(worker->wake_fd < 0 && worker->num_pending != 0)
+    ftp_worker_adopt(worker);
+
+  /* replies go out once every handler of the round has had its say */
+  ftp_worker_flush(worker);
+
+  /* sessions are destroyed after the batch so no event refers to them */
+  if(worker->reap_sessions)
+    ftp_reap_sessions(worker);
+
+#ifdef FTP_USE_IO_URING
+  /* one submission for every request queued this round */
+  if(worker->ring.to_submit != 0)
+    uring_submit(&worker->ring, 0);
+#endif
+
+  return 0;
+}
+
+/*! worker thread entry point
+ *
+ *  @param[in] arg worker (ftp_worker_t*)
+ */
+static void
+ftp_worker_thread(void *arg)
+{
+  ftp_worker_t *worker = (ftp_worker_t*)arg;
+  int          timeout = worker->wake_fd >= 0 ? LOOP_TIMEOUT : WAKE_TIMEOUT;
+
+  while(!__atomic_load_n(&worker->quit, __ATOMIC_ACQUIRE))
+  {
+    if(ftp_worker_loop(worker, timeout) != 0)
+      break;
+  }
+}
+
+#ifdef FTP_USE_IO_URING
+/*! deinitialize io_uring for a worker
+ *
+ *  @param[in] worker worker
+ */
+static void
+ftp_worker_exit_ring(ftp_worker_t *worker)
+{
+  if(worker->ring_event_fd >= 0)
+  {
+    ftp_watch_set(worker, &worker->ring_watch, -1, 0);
+    if(close(worker->ring_event_fd) != 0)
+      console_print(RED "close: %d %s\n" RESET, errno, strerror(errno));
+    worker->ring_event_fd = -1;
+  }
+
+  if(worker->ring.fd >= 0)
+    uring_exit(&worker->ring);
+
+  free(worker->ring_buffers);
+  worker->ring_buffers     = NULL;
+  worker->ring_fixed       = 0;
+  worker->num_free_buffers = 0;
+}
+
+/*! initialize io_uring for a worker
+ *
+ *  @param[in] worker worker
+ *
+ *  @note transfers use the readiness path if this fails
+ */
+static void
+ftp_worker_init_ring(ftp_worker_t *worker)
+{
+  struct iovec iov[URING_BUFFERS];
+  int          i;
+
+  if(uring_init(&worker->ring, URING_ENTRIES) != 0)
+    return;
+
+  worker->ring_buffers = (char*)memalign(URING_BUFFERSIZE, URING_BUFFERS*URING_BUFFERSIZE);
+  if(worker->ring_buffers == NULL)
+  {
+    console_print(RED "failed to allocate io_uring buffers\n" RESET);
+    ftp_worker_exit_ring(worker);
+    return;
+  }
+
+  /* completions wake the worker through the event engine */
+  worker->ring_event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  if(worker->ring_event_fd < 0)
+  {
+    console_print(RED "eventfd: %d %s\n" RESET, errno, strerror(errno));
+    ftp_worker_exit_ring(worker);
+    return;
+  }
+
+  ftp_watch_set(worker, &worker->ring_watch, worker->ring_event_fd, POLLIN);
+  if(worker->ring_watch.fd != worker->ring_event_fd
+  || uring_register_eventfd(&worker->ring, worker->ring_event_fd) != 0)
+  {
+    ftp_worker_exit_ring(worker);
+    return;
+  }
+
+  for(i = 0; i < URING_BUFFERS; ++i)
+  {
+    iov[i].iov_base = worker->ring_buffers + (size_t)i*URING_BUFFERSIZE;
+    iov[i].iov_len  = URING_BUFFERSIZE;
+    worker->free_buffers[i] = URING_BUFFERS - 1 - i;
+  }
+  worker->num_free_buffers = URING_BUFFERS;
+
+  /* it's okay if this fails; requests just won't use fixed buffers */
+  worker->ring_fixed = uring_register_buffers(&worker->ring, iov, URING_BUFFERS) == 0;
+}
+#endif
+
+/*! start the disk thread for a worker
+ *
+ *  @param[in] worker worker
+ *
+ *  @note transfers do their file I/O on the worker thread if this fails
+ */
+static void
+ftp_worker_init_disk(ftp_worker_t *worker)
+{
+  if(event_init(&worker->disk_event) != 0)
+    return;
+
+  if(thread_create(&worker->disk_thread, ftp_disk_thread, worker, -1) != 0)
+  {
+    event_destroy(&worker->disk_event);
+    return;
+  }
+
+  worker->disk_running = 1;
+}
+
+/*! stop the disk thread for a worker
+ *
+ *  @param[in] worker worker
+ *
+ *  @note every session must have let go of its stage
+ */
+static void
+ftp_worker_exit_disk(ftp_worker_t *worker)
+{
+  if(!worker->disk_running)
+    return;
+
+  /* the disk thread finishes with abandoned stages first */
+  mutex_lock(&worker->lock);
+  worker->disk_quit = 1;
+  mutex_unlock(&worker->lock);
+  event_signal(&worker->disk_event);
+  thread_join(worker->disk_thread);
+  worker->disk_running = 0;
+
+  /* free what it handed back */
+  ftp_worker_collect(worker);
+  event_destroy(&worker->disk_event);
+}
+
+/*! start the stat threads for a worker
+ *
+ *  @param[in] worker worker
+ *
+ *  @note listings stat their entries on the worker thread without them
+ */
+static void
+ftp_worker_init_stat(ftp_worker_t *worker)
+{
+  unsigned int i, count = ftp_config.stat_threads;
+
+  if(count > MAX_STAT_THREADS)
+    count = MAX_STAT_THREADS;
+  if(count == 0 || event_init(&worker->stat_event) != 0)
+    return;
+
+  for(i = 0; i < count; ++i)
+  {
+    if(thread_create(&worker->stat_threads[i], ftp_stat_thread, worker, -1) != 0)
+      break;
+    ++worker->num_stat_threads;
+  }
+
+  if(worker->num_stat_threads == 0)
+    event_destroy(&worker->stat_event);
+}
+
+/*! stop the stat threads for a worker
+ *
+ *  @param[in] worker worker
+ *
+ *  @note every session must have let go of its read-ahead window
+ */
+static void
+ftp_worker_exit_stat(ftp_worker_t *worker)
+{
+  unsigned int i;
+
+  if(worker->num_stat_threads == 0)
+    return;
+
+  /* each thread passes the signal on as it leaves */
+  mutex_lock(&worker->lock);
+  worker->stat_quit = 1;
+  mutex_unlock(&worker->lock);
+  event_signal(&worker->stat_event);
+
+  for(i = 0; i < worker->num_stat_threads; ++i)
+    thread_join(worker->stat_threads[i]);
+  worker->num_stat_threads = 0;
+  event_destroy(&worker->stat_event);
+}
+
+/*! initialize a worker
+ *
+ *  @param[in] worker worker to initialize
+ *
+ *  @returns -1 for error
+ */
+static int
+ftp_worker_init(ftp_worker_t *worker)
+{
+  memset(worker, 0, sizeof(*worker));
+  worker->wake_fd            = -1;
+  worker->wake_watch.session = NULL;
+  worker->wake_watch.fd      = -1;
+  worker->wake_watch.slot    = -1;
+#ifdef FTP_USE_EPOLL
+  worker->epollfd            = -1;
+#endif
+#ifdef FTP_USE_IO_URING
+  worker->ring.fd            = -1;
+  worker->ring_event_fd      = -1;
+  worker->ring_watch.session = NULL;
+  worker->ring_watch.fd      = -1;
+  worker->ring_watch.slot    = -1;
+#endif
+
+  ftp_pool_init(&worker->session_pool, sizeof(ftp_session_t), SESSION_SLAB, 0);
+  ftp_pool_init(&worker->xfer_pool, XFER_BUFFERSIZE, 1, POOL_KEEP);
+  ftp_pool_init(&worker->stage_pool, sizeof(ftp_stage_t), SESSION_SLAB, 0);
+
+  if(mutex_init(&worker->lock) != 0)
+    return -1;
+
+#ifdef FTP_USE_EPOLL
+  /* create event engine */
+  worker->epollfd = epoll_create1(EPOLL_CLOEXEC);
+  if(worker->epollfd < 0)
+  {
+    console_print(RED "epoll_create1: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+#endif
+
+#ifdef FTP_USE_EVENTFD
+  /* let the acceptor wake us up */
+  worker->wake_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  if(worker->wake_fd < 0)
+  {
+    console_print(RED "eventfd: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  ftp_watch_set(worker, &worker->wake_watch, worker->wake_fd, POLLIN);
+  if(worker->wake_watch.fd != worker->wake_fd)
+    return -1;
+#endif
+
+#ifdef FTP_USE_IO_URING
+  ftp_worker_init_ring(worker);
+#endif
+
+  ftp_worker_init_disk(worker);
+  ftp_worker_init_stat(worker);
+
+  return 0;
+}
+
+/*! deinitialize a worker
+ *
+ *  @param[in] worker worker to deinitialize
+ */
+static void
+ftp_worker_exit(ftp_worker_t *worker)
+{
+  size_t        i;
+  uint64_t      val = 1;
+#ifdef FTP_USE_IO_URING
+  ftp_session_t *session;
+#endif
+
+  /* stop worker thread */
+  if(worker->running)
+  {
+    __atomic_store_n(&worker->quit, 1, __ATOMIC_RELEASE);
+    if(worker->wake_fd >= 0 && write(worker->wake_fd, &val, sizeof(val)) < 0)
+      console_print(RED "write: %d %s\n" RESET, errno, strerror(errno));
+    thread_join(worker->thread);
+    worker->running = 0;
+  }
+
+#ifdef FTP_USE_IO_URING
+  /* wait for cancelled transfers to let go of their buffers */
+  for(;;)
+  {
+    size_t pending = 0;
+
+    for(session = worker->sessions; session != NULL; session = session->next)
+    {
+      if(session->io_pending > 0)
+      {
+        if(session->cmd_fd >= 0)
+          ftp_session_close_cmd(session);
+        ftp_session_cancel_io(session);
+        ++pending;
+      }
+    }
+
+    if(pending == 0 || uring_submit(&worker->ring, 1) < 0)
+      break;
+    ftp_worker_reap_ring(worker);
+  }
+#endif
+
+  /* clean up all sessions */
+  while(worker->sessions != NULL)
+    ftp_session_destroy(worker->sessions);
+  ftp_worker_exit_disk(worker);
+  ftp_worker_exit_stat(worker);
+
+  /* close connections which were never adopted */
+  for(i = 0; i < worker->num_pending; ++i)
+    ftp_closesocket(worker->pending[i], 1);
+  free(worker->pending);
+
+  /* destroy event engine */
+  if(worker->wake_fd >= 0)
+  {
+    ftp_watch_set(worker, &worker->wake_watch, -1, 0);
+    if(close(worker->wake_fd) != 0)
+      console_print(RED "close: %d %s\n" RESET, errno, strerror(errno));
+  }
+#ifdef FTP_USE_IO_URING
+  ftp_worker_exit_ring(worker);
+#endif
+#ifdef FTP_USE_EPOLL
+  if(worker->epollfd >= 0 && close(worker->epollfd) != 0)
+    console_print(RED "close: %d %s\n" RESET, errno, strerror(errno));
+#else
+  free(worker->pollfds);
+  free(worker->pollwatches);
+  free(worker->ready_events);
+#endif
+
+  ftp_pool_exit(&worker->session_pool);
+  ftp_pool_exit(&worker->xfer_pool);
+  ftp_pool_exit(&worker->stage_pool);
+
+  mutex_destroy(&worker->lock);
+}
+
+/*! open the metrics listen socket
+ *
+ *  @returns -1 for error
+ *
+ *  @note it listens on the same address as the ftp server
+ */
+static int
+ftp_metrics_listen(void)
+{
+  int                rc, yes = 1;
+  struct sockaddr_in addr = serv_addr;
+
+  metricsfd = socket(AF_INET, SOCK_STREAM, 0);
+  if(metricsfd < 0)
+  {
+    console_print(RED "socket: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  rc = setsockopt(metricsfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  if(rc != 0)
+  {
+    console_print(RED "setsockopt: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  addr.sin_port = htons(ftp_config.metrics_port);
+  rc = bind(metricsfd, (struct sockaddr*)&addr, sizeof(addr));
+  if(rc != 0)
+  {
+    console_print(RED "bind: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  rc = listen(metricsfd, 5);
+  if(rc != 0)
+  {
+    console_print(RED "listen: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  /* a scrape must never block the loop serving the ftp sessions */
+  return ftp_set_socket_nonblocking(metricsfd);
+}
+
+/*! initialize ftp subsystem */
+int
+ftp_init(void)
+{
+  int          rc;
+  unsigned int i;
+
+#ifdef _3DS
+  Result  ret;
+  bool    is_new3ds = false;
+
+#if ENABLE_LOGGING
+  /* open log file */
+  FILE *fp = freopen("/ftbrony.log", "wb", stderr);
+  if(fp == NULL)
+  {
+    console_print(RED "freopen: 0x%08X\n" RESET, errno);
+    goto stderr_fail;
+  }
+
+  /* truncate log file */
+  if(ftruncate(fileno(fp), 0) != 0)
+  {
+    console_print(RED "ftruncate: 0x%08X\n" RESET, errno);
+    goto ftruncate_fail;
+  }
+#endif
+
+  /* allocate buffer for SOC service */
+  SOCU_buffer = (u32*)memalign(SOCU_ALIGN, SOCU_BUFFERSIZE);
+  if(SOCU_buffer == NULL)
+  {
+    console_print(RED "memalign: failed to allocate\n" RESET);
+    goto memalign_fail;
+  }
+
+  /* initialize SOC service */
+  ret = socInit(SOCU_buffer, SOCU_BUFFERSIZE);
+  if(ret != 0)
+  {
+    console_print(RED "socInit: 0x%08X\n" RESET, (unsigned int)ret);
+    goto soc_fail;
+  }
+#else
+  /* a peer resetting a connection shows up as EPIPE, not a signal */
+  signal(SIGPIPE, SIG_IGN);
+#endif
+
+  /* set up the listing cache shared by all workers */
+  if(listcache_init(&list_cache, ftp_config.list_cache,
+                    (uint64_t)ftp_config.list_ttl*1000000) != 0)
+  {
+    ftp_exit();
+    return -1;
+  }
+
+  /* allocate socket to listen for clients */
+  listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  if(listenfd < 0)
+  {
+    console_print(RED "socket: %d %s\n" RESET, errno, strerror(errno));
+    ftp_exit();
+    return -1;
+  }
+
+  /* set socket options */
+  ftp_set_socket_options(listenfd);
+
+  /* get address to listen on */
   serv_addr.sin_family      = AF_INET;
 #ifdef _3DS
-  serv_addr.sin_addr.s_addr = gethostid();
-  serv_addr.sin_port        = htons(LISTEN_PORT);
+  serv_addr.sin_addr.s_addr = gethostid();
+  serv_addr.sin_port        = htons(LISTEN_PORT);
+#else
+  serv_addr.sin_addr.s_addr = INADDR_ANY;
+  serv_addr.sin_port        = htons(LISTEN_PORT);
+#endif
+
+  /* reuse address */
+  {
+    int yes = 1;
+    rc = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if(rc != 0)
+    {
+      console_print(RED "setsockopt: %d %s\n" RESET, errno, strerror(errno));
+      ftp_exit();
+      return -1;
+    }
+  }
+
+  /* bind socket to listen address */
+  rc = bind(listenfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
+  if(rc != 0)
+  {
+    console_print(RED "bind: %d %s\n" RESET, errno, strerror(errno));
+    ftp_exit();
+    return -1;
+  }
+
+  /* listen on socket */
+  rc = listen(listenfd, 5);
+  if(rc != 0)
+  {
+    console_print(RED "listen: %d %s\n" RESET, errno, strerror(errno));
+    ftp_exit();
+    return -1;
+  }
+
+#ifdef FTP_USE_EPOLL
+  /* accept connections until EWOULDBLOCK */
+  rc = ftp_set_socket_nonblocking(listenfd);
+  if(rc != 0)
+  {
+    ftp_exit();
+    return -1;
+  }
+#endif
+
+  /* create session workers; default to one per core */
+  num_workers = ftp_config.workers;
+#ifdef _3DS
+  APT_CheckNew3DS(&is_new3ds);
+  if(num_workers == 0)
+    num_workers = is_new3ds ? 2 : 1;
+#else
+  if(num_workers == 0)
+    num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if(num_workers < 1)
+    num_workers = 1;
+  else if(num_workers > MAX_WORKERS)
+    num_workers = MAX_WORKERS;
+
+  workers = (ftp_worker_t*)calloc(num_workers, sizeof(ftp_worker_t));
+  if(workers == NULL)
+  {
+    console_print(RED "failed to allocate workers\n" RESET);
+    num_workers = 0;
+    ftp_exit();
+    return -1;
+  }
+
+  for(i = 0; i < num_workers; ++i)
+  {
+    if(ftp_worker_init(&workers[i]) != 0)
+    {
+      /* only clean up the ones that got initialized */
+      num_workers = i + 1;
+      ftp_exit();
+      return -1;
+    }
+  }
+
+  /* the first worker also waits for clients */
+  ftp_watch_set(&workers[0], &listen_watch, listenfd, POLLIN);
+  if(listen_watch.fd != listenfd)
+  {
+    ftp_exit();
+    return -1;
+  }
+
+  /* and for metrics requests, if they are enabled */
+  for(i = 0; i < MAX_SCRAPES; ++i)
+  {
+    scrapes[i].watch.session = NULL;
+    scrapes[i].watch.fd      = -1;
+    scrapes[i].watch.events  = 0;
+    scrapes[i].watch.slot    = -1;
+    scrapes[i].size          = 0;
+  }
+  if(ftp_config.metrics_port != 0)
+  {
+    if(ftp_metrics_listen() != 0)
+    {
+      ftp_exit();
+      return -1;
+    }
+
+    ftp_watch_set(&workers[0], &metrics_watch, metricsfd, POLLIN);
+    if(metrics_watch.fd != metricsfd)
+    {
+      ftp_exit();
+      return -1;
+    }
+    console_print(CYAN "serving metrics on port %u\n" RESET, ftp_config.metrics_port);
+  }
+
+  /* the other workers get their own threads */
+  for(i = 1; i < num_workers; ++i)
+  {
+#ifdef _3DS
+    /* put the first extra worker on the New 3DS's spare core */
+    int core = (i == 1 && is_new3ds) ? 2 : -1;
+#else
+    int core = -1;
+#endif
+
+    if(thread_create(&workers[i].thread, ftp_worker_thread, &workers[i], core) != 0)
+    {
+      ftp_exit();
+      return -1;
+    }
+    workers[i].running = 1;
+  }
+
+  /* print server address */
+#ifdef _3DS
+  console_set_status("\n" GREEN STATUS_STRING " "
+                     YELLOW "IP:"   CYAN "%s "
+                     YELLOW "Port:" CYAN "%u"
+                     RESET,
+                     inet_ntoa(serv_addr.sin_addr),
+                     ntohs(serv_addr.sin_port));
+#else
+  {
+    char      hostname[128];
+    socklen_t addrlen = sizeof(serv_addr);
+    rc = getsockname(listenfd, (struct sockaddr*)&serv_addr, &addrlen);
+    if(rc != 0)
+    {
+      console_print(RED "getsockname: %d %s\n" RESET, errno, strerror(errno));
+      ftp_exit();
+      return -1;
+    }
+
+    rc = gethostname(hostname, sizeof(hostname));
+    if(rc != 0)
+    {
+      console_print(RED "gethostname: %d %s\n" RESET, errno, strerror(errno));
+      ftp_exit();
+      return -1;
+    }
+
+    console_set_status(GREEN STATUS_STRING " "
+                       YELLOW "IP:"   CYAN "%s "
+                       YELLOW "Port:" CYAN "%u"
+                       RESET,
+                       hostname,
+                       ntohs(serv_addr.sin_port));
+  }
+#endif
+
+  return 0;
+
+#ifdef _3DS
+soc_fail:
+  free(SOCU_buffer);
+
+memalign_fail:
+#ifdef ENABLE_LOGGING
+ftruncate_fail:
+  if(fclose(stderr) != 0)
+    console_print(RED "fclose: 0x%08X\n" RESET, errno);
+
+stderr_fail:
+#endif
+  return -1;
+
+#endif
+}
+
+/*! deinitialize ftp subsystem */
+void
+ftp_exit(void)
+{
+  unsigned int i;
+#ifdef _3DS
+  Result       ret;
+#endif
+
+  /* stop listening for new clients */
+  if(num_workers > 0)
+    ftp_watch_set(&workers[0], &listen_watch, -1, 0);
+  if(listenfd >= 0)
+    ftp_closesocket(listenfd, 0);
+  listenfd = -1;
+
+  /* and for metrics requests */
+  for(i = 0; i < MAX_SCRAPES; ++i)
+  {
+    if(scrapes[i].watch.fd >= 0)
+      ftp_scrape_close(&scrapes[i]);
+  }
+  if(num_workers > 0)
+    ftp_watch_set(&workers[0], &metrics_watch, -1, 0);
+  if(metricsfd >= 0)
+    ftp_closesocket(metricsfd, 0);
+  metricsfd = -1;
+
+  /* stop workers and clean up all sessions */
+  for(i = num_workers; i > 0; --i)
+    ftp_worker_exit(&workers[i-1]);
+  free(workers);
+  workers     = NULL;
+  num_workers = 0;
+
+  /* every session has given back its cached listing */
+  listcache_exit(&list_cache);
+
+#ifdef _3DS
+  /* deinitialize SOC service */
+  ret = socExit();
+  if(ret != 0)
+    console_print(RED "socExit: 0x%08X\n" RESET, (unsigned int)ret);
+  free(SOCU_buffer);
+
+#ifdef ENABLE_LOGGING
+  /* close log file */
+  if(fclose(stderr) != 0)
+    console_print(RED "fclose: 0x%08X\n" RESET, errno);
+
+#endif
+
+#endif
+}
+
+/*! ftp loop
+ *
+ *  @returns -1 to exit
+ */
+int
+ftp_loop(void)
+{
+  int timeout = workers[0].wake_fd >= 0 ? LOOP_TIMEOUT : WAKE_TIMEOUT;
+
+  /* the main thread runs the acceptor and the first worker; without
+   * wake_fd it has to look for disk thread progress periodically */
+  if(ftp_worker_loop(&workers[0], timeout) != 0)
+    return -1;
+
+#ifdef _3DS
+  hidScanInput();
+  if(hidKeysDown() & KEY_B)
+    return -1;
+#endif
+
+  return 0;
+}
+
+static void
+cd_up(ftp_session_t *session)
+{
+  char *slash = NULL, *p;
+
+  for(p = session->cwd; *p; ++p)
+  {
+    if(*p == '/')
+      slash = p;
+  }
+  *slash = 0;
+  if(strlen(session->cwd) == 0)
+    strcat(session->cwd, "/");
+}
+
+static int
+validate_path(const char *args)
+{
+  const char *p;
+
+  /* make sure no path components are '..' */
+  p = args;
+  while((p = strstr(p, "/..")) != NULL)
+  {
+    if(p[3] == 0 || p[3] == '/')
+      return -1;
+  }
+
+  /* make sure there are no '//' */
+  if(strstr(args, "//") != NULL)
+    return -1;
+
+  return 0;
+}
+
+static int
+build_path(ftp_session_t *session,
+           const char    *args)
+{
+  int  rc;
+  char *p;
+
+  if(ftp_session_get_buffer(session) != 0)
+  {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  memset(session->buffer, 0, XFER_BUFFERSIZE);
+
+  if(validate_path(args) != 0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if(args[0] == '/')
+  {
+    if(strlen(args) > XFER_BUFFERSIZE-1)
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    strncpy(session->buffer, args, XFER_BUFFERSIZE);
+  }
+  else
+  {
+    if(strcmp(session->cwd, "/") == 0)
+      rc = snprintf(session->buffer, XFER_BUFFERSIZE, "/%s",
+                    args);
+    else
+      rc = snprintf(session->buffer, XFER_BUFFERSIZE, "%s/%s",
+                    session->cwd, args);
+
+    if(rc >= XFER_BUFFERSIZE)
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+  }
+
+  p = session->buffer + strlen(session->buffer);
+  while(p > session->buffer && *--p == '/')
+    *p = 0;
+
+  if(strlen(session->buffer) == 0)
+    strcpy(session->buffer, "/");
+
+  return 0;
+}
+
+/*! send the unsent part of a rendered listing to peer
+ *
+ *  @param[in] session ftp session
+ *  @param[in] data    listing; bufferpos and buffersize index into it
+ *
+ *  @returns -1 when the callback should not be called again this round
+ */
+static int
+list_send(ftp_session_t *session,
+          const char    *data)
+{
+  ssize_t rc;
+
+  rc = send(session->data_fd, data + session->bufferpos,
+            session->buffersize - session->bufferpos, 0);
+  ++session->xfer_syscalls;
+  if(rc <= 0)
+  {
+    if(rc < 0)
+    {
+      if(errno == EWOULDBLOCK)
+        return -1;
+      console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
+    }
+    else
+      console_print(YELLOW "send: %d %s\n" RESET, ECONNRESET, strerror(ECONNRESET));
+
+    ftp_session_set_state(session, COMMAND_STATE);
+    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
+    return -1;
+  }
+
+  /* a partial send leaves the rest of the buffer for the next call */
+  session->bufferpos   += rc;
+  session->xfer_bytes  += rc;
+  session->xfer_copied += rc;
+  return 0;
+}
+
+/*! render RFC 3659 facts
+ *
+ *  @param[out] out   buffer with room for FACTS_MAX bytes
+ *  @param[in]  st    attributes
+ *  @param[in]  facts facts to render
+ *
+ *  @returns length of the facts
+ */
+static int
+ftp_format_facts(char              *out,
+                 const struct stat *st,
+                 int               facts)
+{
+  char      *p = out;
+  struct tm tm;
+
+  if(facts & FACT_TYPE)
+    p += sprintf(p, "type=%s;",
+                 S_ISDIR(st->st_mode) ? "dir" :
+                 S_ISLNK(st->st_mode) ? "OS.unix=symlink" : "file");
+
+  if((facts & FACT_SIZE) && !S_ISDIR(st->st_mode))
+    p += sprintf(p, "size=%llu;", (unsigned long long)st->st_size);
+
+  if((facts & FACT_MODIFY) && gmtime_r(&st->st_mtime, &tm) != NULL)
+    p += strftime(p, FACTS_MAX - (p - out), "modify=%Y%m%d%H%M%S;", &tm);
+
+  /* nothing is enforced beyond what the file system allows */
+  if(facts & FACT_PERM)
+  {
+    if(S_ISDIR(st->st_mode))
+      p += sprintf(p, "perm=%s;", (st->st_mode & S_IWUSR) ? "cdeflmp" : "el");
+    else
+      p += sprintf(p, "perm=%s;", (st->st_mode & S_IWUSR) ? "adfrw" : "r");
+  }
+
+  *p = 0;
+  return p - out;
+}
+
+/*! get the attributes of a directory entry being listed
+ *
+ *  @param[in]  session ftp session reading session->dp
+ *  @param[in]  dent    entry returned by readdir()
+ *  @param[out] st      attributes
+ *  @param[in]  full    directories need more than their type
+ *  @param[in]  scratch space for the full path where there is no fstatat()
+ *
+ *  @returns -1 for error
+ *
+ *  @note unless full is set a directory only gets st_mode; its size means
+ *        nothing to clients, so the type from readdir() saves the stat call
+ */
+static int
+ftp_session_stat_entry(ftp_session_t *session,
+                       struct dirent *dent,
+                       struct stat   *st,
+                       int           full,
+                       char          *scratch)
+{
+#ifdef DT_DIR
+  if(!full && dent->d_type == DT_DIR)
+  {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFDIR;
+    return 0;
+  }
+#endif
+
+  ++session->list_stats;
+  ++session->xfer_syscalls;
+
+#ifdef _3DS
+  if(strcmp(session->list_path, "/") == 0)
+    sprintf(scratch, "/%s", dent->d_name);
+  else
+    sprintf(scratch, "%s/%s", session->list_path, dent->d_name);
+  if(lstat(scratch, st) != 0)
+  {
+    console_print(RED "stat '%s': %d %s\n" RESET, scratch, errno, strerror(errno));
+    return -1;
+  }
 #else
-  serv_addr.sin_addr.s_addr = INADDR_ANY;
-  serv_addr.sin_port        = htons(LISTEN_PORT);
+  /* look the name up in the open directory instead of walking its path again */
+  if(fstatat(dirfd(session->dp), dent->d_name, st, AT_SYMLINK_NOFOLLOW) != 0)
+  {
+    console_print(RED "fstatat '%s': %d %s\n" RESET, dent->d_name, errno, strerror(errno));
+    return -1;
+  }
 #endif
 
-  /* reuse address */
+  return 0;
+}
+
+/*! render one line of a listing into the transfer buffer
+ *
+ *  @param[in] session ftp session
+ *  @param[in] name    entry name
+ *  @param[in] st      entry attributes
+ */
+static void
+ftp_session_format_entry(ftp_session_t     *session,
+                         const char        *name,
+                         const struct stat *st)
+{
+  if(session->list_format == MLSD_FORMAT)
+  {
+    session->buffersize +=
+        ftp_format_facts(session->buffer + session->buffersize, st,
+                         session->list_facts);
+    session->buffersize +=
+        sprintf(session->buffer + session->buffersize, " %s\r\n", name);
+  }
+  else
+  {
+    session->buffersize +=
+        sprintf(session->buffer + session->buffersize,
+                "%crwxrwxrwx 1 3DS 3DS %llu Jan 1 1970 %s\r\n",
+                S_ISDIR(st->st_mode) ? 'd' :
+                S_ISLNK(st->st_mode) ? 'l' : '-',
+                (unsigned long long)st->st_size,
+                name);
+  }
+}
+
+/*! fill the transfer buffer with listing lines read from the directory
+ *
+ *  @param[in] session ftp session
+ *  @param[in] reserve room needed for one line plus scratch space
+ *
+ *  @returns -1 if the transfer failed
+ */
+static int
+ftp_session_fill_list(ftp_session_t *session,
+                      size_t        reserve)
+{
+  int           rc;
+  struct stat   st;
+  struct dirent *dent;
+
+  /* the free space doubles as scratch space for a path to stat */
+  while(XFER_BUFFERSIZE - session->buffersize >= reserve)
+  {
+    dent = readdir(session->dp);
+    if(dent == NULL)
+    {
+      /* send what is left, then finish */
+      ftp_session_close_dir(session);
+      break;
+    }
+
+    if(strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+      continue;
+
+    ++session->list_entries;
+    if(session->list_format == NLST_FORMAT)
+    {
+      /* names come straight from readdir(); nothing to stat */
+      session->buffersize +=
+          sprintf(session->buffer + session->buffersize, "%s\r\n",
+                  dent->d_name);
+      continue;
+    }
+
+    rc = ftp_session_stat_entry(session, dent, &st,
+                                session->list_facts & (FACT_MODIFY|FACT_PERM),
+                                session->buffer + session->buffersize);
+    if(rc != 0)
+    {
+      ftp_session_set_state(session, COMMAND_STATE);
+      ftp_send_response(session, 550, "unavailable\r\n");
+      return -1;
+    }
+
+    ftp_session_format_entry(session, dent->d_name, &st);
+  }
+
+  return 0;
+}
+
+/*! fill the transfer buffer with listing lines whose attributes the stat
+ *  threads fetched
+ *
+ *  @param[in] session ftp session
+ *  @param[in] reserve room needed for one line
+ *
+ *  @returns -1 if the transfer failed or has to wait for a stat thread
+ */
+static int
+ftp_session_fill_prefetched(ftp_session_t *session,
+                            size_t        reserve)
+{
+  ftp_worker_t         *worker   = session->worker;
+  ftp_prefetch_t       *prefetch = session->prefetch;
+  ftp_prefetch_entry_t *entry;
+
+  while(prefetch->head != prefetch->tail
+     && XFER_BUFFERSIZE - session->buffersize >= reserve)
+  {
+    entry = &prefetch->entry[prefetch->head % PREFETCH_ENTRIES];
+    if(!__atomic_load_n(&entry->ready, __ATOMIC_ACQUIRE))
+    {
+      /* send what is ready instead of waiting */
+      if(session->buffersize != 0)
+        break;
+
+      /* the stat thread wakes us up when it is done with it */
+      mutex_lock(&worker->lock);
+      if(!__atomic_load_n(&entry->ready, __ATOMIC_ACQUIRE))
+      {
+        __atomic_store_n(&prefetch->waiting, 1, __ATOMIC_RELAXED);
+        mutex_unlock(&worker->lock);
+        return -1;
+      }
+      mutex_unlock(&worker->lock);
+    }
+
+    if(entry->error != 0)
+    {
+      ftp_session_set_state(session, COMMAND_STATE);
+      ftp_send_response(session, 550, "unavailable\r\n");
+      return -1;
+    }
+
+    ++session->list_entries;
+    ftp_session_format_entry(session, entry->name, &entry->st);
+    ++prefetch->head;
+
+    /* keep the stat threads ahead of us */
+    if(prefetch->tail - prefetch->head < PREFETCH_ENTRIES / 2)
+      ftp_session_read_ahead(session);
+  }
+
+  return 0;
+}
+
+/*! send directory listing to peer
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 when the callback should not be called again this round
+ */
+static int
+list_transfer(ftp_session_t *session)
+{
+  int    rc;
+  size_t reserve;
+
+  if(session->bufferpos == session->buffersize)
   {
-    int yes = 1;
-    rc = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    /* the whole listing has been sent */
+    if(ftp_session_list_done(session))
+    {
+      /* count the stat threads' calls too */
+      ftp_session_put_prefetch(session);
+      console_print(CYAN "listed %llu entries with %llu stat calls\n" RESET,
+                    (unsigned long long)session->list_entries,
+                    (unsigned long long)session->list_stats);
+      ftp_metric_add(&session->worker->metrics.list_entries, session->list_entries);
+
+      ftp_session_set_state(session, COMMAND_STATE);
+      ftp_send_response(session, 226, "OK\r\n");
+      return -1;
+    }
+
+    /* fill the buffer with as many lines as fit so each send() moves many
+     * entries
+     */
+    session->bufferpos  = 0;
+    session->buffersize = 0;
+    reserve = strlen(session->list_path) + sizeof(((struct dirent*)0)->d_name) + FACTS_MAX;
+    if(session->prefetch != NULL)
+      rc = ftp_session_fill_prefetched(session, reserve);
+    else
+      rc = ftp_session_fill_list(session, reserve);
     if(rc != 0)
+      return -1;
+
+    /* keep a copy for the next listing of this directory */
+    ftp_session_capture(session);
+
+    if(session->buffersize == 0)
+      return 0;
+  }
+
+  return list_send(session, session->buffer);
+}
+
+/*! send a cached directory listing to peer
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 when the callback should not be called again this round
+ */
+static int
+cached_list_transfer(ftp_session_t *session)
+{
+  if(session->bufferpos == session->listing->size)
+  {
+    ftp_metric_add(&session->worker->metrics.list_entries, session->listing->entries);
+    ftp_session_set_state(session, COMMAND_STATE);
+    ftp_send_response(session, 226, "OK\r\n");
+    return -1;
+  }
+
+  session->buffersize = session->listing->size;
+  return list_send(session, session->listing->data);
+}
+
+static int
+retrieve_transfer(ftp_session_t *session)
+{
+  ssize_t rc;
+
+  if(session->bufferpos == session->buffersize)
+  {
+    rc = ftp_session_read_file(session);
+    if(rc <= 0)
     {
-      console_print(RED "setsockopt: %d %s\n" RESET, errno, strerror(errno));
-      ftp_exit();
+      ftp_session_close_file(session);
+      ftp_session_set_state(session, COMMAND_STATE);
+      if(rc < 0)
+        ftp_send_response(session, 451, "Failed to read file\r\n");
+      else
+        ftp_send_response(session, 226, "OK\r\n");
       return -1;
     }
+
+    session->bufferpos  = 0;
+    session->buffersize = rc;
   }
 
-  /* bind socket to listen address */
-  rc = bind(listenfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
-  if(rc != 0)
+  rc = send(session->data_fd, session->buffer + session->bufferpos,
+            session->buffersize - session->bufferpos, 0);
+  ++session->xfer_syscalls;
+  if(rc <= 0)
   {
-    console_print(RED "bind: %d %s\n" RESET, errno, strerror(errno));
-    ftp_exit();
+    if(rc < 0)
+    {
+      if(errno == EWOULDBLOCK)
+        return -1;
+      console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
+    }
+    else
+      console_print(YELLOW "send: %d %s\n" RESET, ECONNRESET, strerror(ECONNRESET));
+
+    ftp_session_close_file(session);
+    ftp_session_set_state(session, COMMAND_STATE);
+    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
     return -1;
   }
 
-  /* listen on socket */
-  rc = listen(listenfd, 5);
-  if(rc != 0)
+  session->bufferpos   += rc;
+  session->xfer_bytes  += rc;
+  session->xfer_copied += rc;
+  return 0;
+}
+
+/*! send file to peer from buffers the disk thread reads ahead
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 when the callback should not be called again this round
+ */
+static int
+readahead_transfer(ftp_session_t *session)
+{
+  ftp_stage_t  *stage = session->stage;
+  unsigned int slot;
+  ssize_t      rc;
+
+  if(stage == NULL)
   {
-    console_print(RED "listen: %d %s\n" RESET, errno, strerror(errno));
-    ftp_exit();
+    if(ftp_session_get_stage(session, 0) != 0)
+    {
+      /* no disk thread; read the file ourselves */
+      session->transfer = retrieve_transfer;
+      return 0;
+    }
+
+    /* the path isn't needed anymore */
+    ftp_session_put_buffer(session);
+    ftp_session_queue_stage(session);
     return -1;
   }
 
-  /* print server address */
-#ifdef _3DS
-  console_set_status("\n" GREEN STATUS_STRING " "
-                     YELLOW "IP:"   CYAN "%s "
-                     YELLOW "Port:" CYAN "%u"
-                     RESET,
-                     inet_ntoa(serv_addr.sin_addr),
-                     ntohs(serv_addr.sin_port));
-#else
+  if(__atomic_load_n(&stage->head, __ATOMIC_ACQUIRE) == stage->tail)
   {
-    char      hostname[128];
-    socklen_t addrlen = sizeof(serv_addr);
-    rc = getsockname(listenfd, (struct sockaddr*)&serv_addr, &addrlen);
-    if(rc != 0)
+    /* the disk thread publishes every buffer before eof or error */
+    if(__atomic_load_n(&stage->error, __ATOMIC_ACQUIRE) != 0)
     {
-      console_print(RED "getsockname: %d %s\n" RESET, errno, strerror(errno));
-      ftp_exit();
+      ftp_session_set_state(session, COMMAND_STATE);
+      ftp_send_response(session, 451, "Failed to read file\r\n");
       return -1;
     }
 
-    rc = gethostname(hostname, sizeof(hostname));
-    if(rc != 0)
+    if(__atomic_load_n(&stage->eof, __ATOMIC_ACQUIRE)
+    && __atomic_load_n(&stage->head, __ATOMIC_ACQUIRE) == stage->tail)
     {
-      console_print(RED "gethostname: %d %s\n" RESET, errno, strerror(errno));
-      ftp_exit();
+      ftp_session_set_state(session, COMMAND_STATE);
+      ftp_send_response(session, 226, "OK\r\n");
       return -1;
     }
 
-    console_set_status(GREEN STATUS_STRING " "
-                       YELLOW "IP:"   CYAN "%s "
-                       YELLOW "Port:" CYAN "%u"
-                       RESET,
-                       hostname,
-                       ntohs(serv_addr.sin_port));
+    /* wait for the disk thread */
+    return -1;
   }
-#endif
 
-  return 0;
+  slot = stage->tail % STAGE_BUFFERS;
+  rc = send(session->data_fd, stage->buffer[slot] + stage->pos,
+            stage->length[slot] - stage->pos, 0);
+  ++session->xfer_syscalls;
+  if(rc <= 0)
+  {
+    if(rc < 0)
+    {
+      if(errno == EWOULDBLOCK)
+        return -1;
+      console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
+    }
+    else
+      console_print(YELLOW "send: %d %s\n" RESET, ECONNRESET, strerror(ECONNRESET));
 
-#ifdef _3DS
-soc_fail:
-  free(SOCU_buffer);
+    ftp_session_set_state(session, COMMAND_STATE);
+    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
+    return -1;
+  }
 
-memalign_fail:
-#ifdef ENABLE_LOGGING
-ftruncate_fail:
-  if(fclose(stderr) != 0)
-    console_print(RED "fclose: 0x%08X\n" RESET, errno);
+  stage->pos           += rc;
+  session->xfer_bytes  += rc;
+  session->xfer_copied += rc;
 
-stderr_fail:
-#endif
-  return -1;
+  if(stage->pos == stage->length[slot])
+  {
+    /* give the buffer back to the disk thread */
+    stage->pos = 0;
+    __atomic_store_n(&stage->tail, stage->tail + 1, __ATOMIC_RELEASE);
+    ftp_session_queue_stage(session);
+  }
 
-#endif
+  return 0;
 }
 
-/*! deinitialize ftp subsystem */
-void
-ftp_exit(void)
+#ifdef FTP_USE_SENDFILE
+/*! send file to peer straight from the page cache
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 when the callback should not be called again this round
+ */
+static int
+sendfile_transfer(ftp_session_t *session)
 {
-#ifdef _3DS
-  Result ret;
-#endif
+  ssize_t rc;
+  off_t   offset = session->filepos;
 
-  /* clean up all sessions */
-  while(sessions != NULL)
-    ftp_session_destroy(sessions);
+  /* the kernel copies from the file to the socket; stdio is bypassed */
+  rc = sendfile(session->data_fd, session->file_fd, &offset,
+                ftp_session_quantum(session, SENDFILE_CHUNK));
+  ++session->xfer_syscalls;
+  if(rc < 0)
+  {
+    int err = errno;
 
-  /* stop listening for new clients */
-  if(listenfd >= 0)
-    ftp_closesocket(listenfd, 0);
+    if(err == EWOULDBLOCK)
+      return -1;
 
-#ifdef _3DS
-  /* deinitialize SOC service */
-  ret = socExit();
-  if(ret != 0)
-    console_print(RED "socExit: 0x%08X\n" RESET, (unsigned int)ret);
-  free(SOCU_buffer);
+    if(err == EINVAL || err == ENOSYS)
+    {
+      /* this file can't be sent this way; read it into buffers instead */
+      if(lseek(session->file_fd, session->filepos, SEEK_SET) == session->filepos)
+      {
+        session->transfer = readahead_transfer;
+        return 0;
+      }
+    }
 
-#ifdef ENABLE_LOGGING
-  /* close log file */
-  if(fclose(stderr) != 0)
-    console_print(RED "fclose: 0x%08X\n" RESET, errno);
+    console_print(RED "sendfile: %d %s\n" RESET, err, strerror(err));
+    ftp_session_close_file(session);
+    ftp_session_set_state(session, COMMAND_STATE);
+    if(err == EIO)
+      ftp_send_response(session, 451, "Failed to read file\r\n");
+    else
+      ftp_send_response(session, 426, "Connection broken during transfer\r\n");
+    return -1;
+  }
 
-#endif
+  if(rc == 0)
+  {
+    /* reached end of file */
+    ftp_session_close_file(session);
+    ftp_session_set_state(session, COMMAND_STATE);
+    ftp_send_response(session, 226, "OK\r\n");
+    return -1;
+  }
 
-#endif
+  session->filepos    = offset;
+  session->xfer_bytes += rc;
+  return 0;
 }
+#endif
 
-int
-ftp_loop(void)
+static int
+store_transfer(ftp_session_t *session)
 {
-  int           rc;
-  struct pollfd pollinfo;
-  ftp_session_t *session;
-
-  pollinfo.fd      = listenfd;
-  pollinfo.events  = POLLIN;
-  pollinfo.revents = 0;
+  ssize_t rc;
 
-  rc = poll(&pollinfo, 1, 0);
-  if(rc < 0)
-  {
-    console_print(RED "poll: %d %s\n" RESET, errno, strerror(errno));
-    return -1;
-  }
-  else if(rc > 0)
+  if(session->bufferpos == session->buffersize)
   {
-    if(pollinfo.revents & POLLIN)
-    {
-      ftp_session_new(listenfd);
-    }
-    else
+    rc = recv(session->data_fd, session->buffer, XFER_BUFFERSIZE, 0);
+    ++session->xfer_syscalls;
+    if(rc <= 0)
     {
-      console_print(YELLOW "listenfd: revents=0x%08X\n" RESET, pollinfo.revents);
+      if(rc < 0)
+      {
+        if(errno == EWOULDBLOCK)
+          return -1;
+        console_print(RED "recv: %d %s\n" RESET, errno, strerror(errno));
+      }
+
+      ftp_session_close_file(session);
+      ftp_session_set_state(session, COMMAND_STATE);
+
+      if(rc == 0)
+      {
+        ftp_send_response(session, 226, "OK\r\n");
+      }
+      else
+        ftp_send_response(session, 426, "Connection broken during transfer\r\n");
+      return -1;
     }
-  }
 
-  session = sessions;
-  while(session != NULL)
-    session = ftp_session_poll(session);
+    session->bufferpos    = 0;
+    session->buffersize   = rc;
+    session->xfer_bytes  += rc;
+    session->xfer_copied += rc;
+  }
 
-#ifdef _3DS
-  hidScanInput();
-  if(hidKeysDown() & KEY_B)
+  rc = ftp_session_write_file(session);
+  if(rc <= 0)
+  {
+    ftp_session_close_file(session);
+    ftp_session_set_state(session, COMMAND_STATE);
+    ftp_send_response(session, 451, "Failed to write file\r\n");
     return -1;
-#endif
+  }
 
+  session->bufferpos += rc;
   return 0;
 }
 
+/*! hand a filled buffer to the disk thread
+ *
+ *  @param[in] session ftp session
+ */
 static void
-cd_up(ftp_session_t *session)
+ftp_session_publish_stage(ftp_session_t *session)
 {
-  char *slash = NULL, *p;
+  ftp_stage_t *stage = session->stage;
 
-  for(p = session->cwd; *p; ++p)
-  {
-    if(*p == '/')
-      slash = p;
-  }
-  *slash = 0;
-  if(strlen(session->cwd) == 0)
-    strcat(session->cwd, "/");
+  stage->length[stage->head % STAGE_BUFFERS] = stage->pos;
+  stage->pos = 0;
+  __atomic_store_n(&stage->head, stage->head + 1, __ATOMIC_RELEASE);
+  ftp_session_queue_stage(session);
 }
 
+/*! receive file from peer into buffers the disk thread writes behind
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 when the callback should not be called again this round
+ *
+ *  @note the reply is only sent once the disk thread has written everything
+ */
 static int
-validate_path(const char *args)
+writebehind_transfer(ftp_session_t *session)
 {
-  const char *p;
+  ftp_stage_t *stage = session->stage;
+  ssize_t     rc;
 
-  /* make sure no path components are '..' */
-  p = args;
-  while((p = strstr(p, "/..")) != NULL)
+  if(stage == NULL)
   {
-    if(p[3] == 0 || p[3] == '/')
-      return -1;
+    if(ftp_session_get_stage(session, 1) != 0)
+    {
+      /* no disk thread; write the file ourselves */
+      session->transfer = store_transfer;
+      return 0;
+    }
+
+    /* the path isn't needed anymore */
+    ftp_session_put_buffer(session);
+    stage = session->stage;
   }
 
-  /* make sure there are no '//' */
-  if(strstr(args, "//") != NULL)
+  if(__atomic_load_n(&stage->error, __ATOMIC_ACQUIRE) != 0)
+  {
+    ftp_session_set_state(session, COMMAND_STATE);
+    ftp_send_response(session, 451, "Failed to write file\r\n");
     return -1;
+  }
 
-  return 0;
-}
-
-static int
-build_path(ftp_session_t *session,
-           const char    *args)
-{
-  int  rc;
-  char *p;
-
-  memset(session->buffer, 0, sizeof(session->buffer));
-
-  if(validate_path(args) != 0)
+  if(stage->eof)
   {
-    errno = EINVAL;
+    /* wait until the disk thread has written everything and let go */
+    if(__atomic_load_n(&stage->tail, __ATOMIC_ACQUIRE) != stage->head
+    || __atomic_load_n(&stage->queued, __ATOMIC_ACQUIRE))
+      return -1;
+
+    rc = ftp_session_put_stage(session);
+    ftp_session_set_state(session, COMMAND_STATE);
+    if(rc != 0)
+      ftp_send_response(session, 451, "Failed to write file\r\n");
+    else
+      ftp_send_response(session, 226, "OK\r\n");
     return -1;
   }
 
-  if(args[0] == '/')
+  /* the ring is full; wait for the disk thread to free a buffer */
+  if(stage->head - __atomic_load_n(&stage->tail, __ATOMIC_ACQUIRE) == STAGE_BUFFERS)
+    return -1;
+
+  rc = recv(session->data_fd, stage->buffer[stage->head % STAGE_BUFFERS] + stage->pos,
+            XFER_BUFFERSIZE - stage->pos, 0);
+  ++session->xfer_syscalls;
+  if(rc < 0)
   {
-    if(strlen(args) > sizeof(session->buffer)-1)
-    {
-      errno = ENAMETOOLONG;
+    if(errno == EWOULDBLOCK)
       return -1;
-    }
-    strncpy(session->buffer, args, sizeof(session->buffer));
+    console_print(RED "recv: %d %s\n" RESET, errno, strerror(errno));
+
+    ftp_session_set_state(session, COMMAND_STATE);
+    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
+    return -1;
   }
-  else
-  {
-    if(strcmp(session->cwd, "/") == 0)
-      rc = snprintf(session->buffer, sizeof(session->buffer), "/%s",
-                    args);
-    else
-      rc = snprintf(session->buffer, sizeof(session->buffer), "%s/%s",
-                    session->cwd, args);
 
-    if(rc >= sizeof(session->buffer))
-    {
-      errno = ENAMETOOLONG;
-      return -1;
-    }
+  if(rc == 0)
+  {
+    /* the peer is done; flush the partial buffer */
+    stage->eof = 1;
+    if(stage->pos != 0)
+      ftp_session_publish_stage(session);
+    return 0;
   }
 
-  p = session->buffer + strlen(session->buffer);
-  while(p > session->buffer && *--p == '/')
-    *p = 0;
+  stage->pos           += rc;
+  session->xfer_bytes  += rc;
+  session->xfer_copied += rc;
 
-  if(strlen(session->buffer) == 0)
-    strcpy(session->buffer, "/");
+  /* only full buffers go to the disk thread so the writes are large */
+  if(stage->pos == XFER_BUFFERSIZE)
+    ftp_session_publish_stage(session);
 
   return 0;
 }
 
+#ifdef FTP_USE_SPLICE
+/*! drain pipe into file through user space
+ *
+ *  @param[in] session ftp session
+ *  @param[in] size    bytes in the pipe
+ *
+ *  @returns -1 for error
+ */
 static int
-list_transfer(ftp_session_t *session)
+ftp_session_drain_pipe(ftp_session_t *session,
+                       size_t        size)
 {
   ssize_t rc;
 
-  if(session->bufferpos == session->buffersize)
+  while(size > 0)
   {
-    struct stat   st;
-    struct dirent *dent = readdir(session->dp);
-    if(dent == NULL)
+    rc = read(session->pipe_fd[0], session->buffer,
+              size < XFER_BUFFERSIZE ? size : XFER_BUFFERSIZE);
+    ++session->xfer_syscalls;
+    if(rc <= 0)
     {
-      ftp_session_close_cwd(session);
-      ftp_session_set_state(session, COMMAND_STATE);
-      ftp_send_response(session, 226, "OK\r\n");
+      console_print(RED "read: %d %s\n" RESET, errno, strerror(errno));
       return -1;
     }
+    size                 -= rc;
+    session->xfer_copied += rc;
 
-    if(strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
-      return 0;
-
-    if(strcmp(session->cwd, "/") == 0)
-      snprintf(session->buffer, sizeof(session->buffer),
-               "/%s", dent->d_name);
-    else
-      snprintf(session->buffer, sizeof(session->buffer),
-               "%s/%s", session->cwd, dent->d_name);
-    rc = lstat(session->buffer, &st);
-    if(rc != 0)
+    session->bufferpos  = 0;
+    session->buffersize = rc;
+    while(session->bufferpos < session->buffersize)
     {
-      console_print(RED "stat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
-      ftp_session_close_cwd(session);
-      ftp_session_set_state(session, COMMAND_STATE);
-      ftp_send_response(session, 550, "unavailable\r\n");
-      return -1;
+      rc = ftp_session_write_file(session);
+      if(rc <= 0)
+        return -1;
+      session->bufferpos += rc;
     }
-
-    session->buffersize =
-        sprintf(session->buffer,
-                "%crwxrwxrwx 1 3DS 3DS %llu Jan 1 1970 %s\r\n",
-                S_ISDIR(st.st_mode) ? 'd' :
-                S_ISLNK(st.st_mode) ? 'l' : '-',
-                (unsigned long long)st.st_size,
-                dent->d_name);
-    session->bufferpos = 0;
   }
 
-  rc = send(session->data_fd, session->buffer + session->bufferpos,
-            session->buffersize - session->bufferpos, 0);
+  session->bufferpos  = 0;
+  session->buffersize = 0;
+  return 0;
+}
+
+/*! receive file from peer into the page cache through a pipe
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 when the callback should not be called again this round
+ */
+static int
+splice_transfer(ftp_session_t *session)
+{
+  ssize_t rc;
+  size_t  size;
+  loff_t  offset;
+
+  /* move what the socket has into the pipe */
+  rc = splice(session->data_fd, NULL, session->pipe_fd[1], NULL,
+              ftp_session_quantum(session, session->pipe_size),
+              SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+  ++session->xfer_syscalls;
   if(rc <= 0)
   {
     if(rc < 0)
     {
       if(errno == EWOULDBLOCK)
         return -1;
-      console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
+      console_print(RED "splice: %d %s\n" RESET, errno, strerror(errno));
     }
-    else
-      console_print(YELLOW "send: %d %s\n" RESET, ECONNRESET, strerror(ECONNRESET));
 
-    ftp_session_close_cwd(session);
+    ftp_session_close_file(session);
     ftp_session_set_state(session, COMMAND_STATE);
-    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
+
+    if(rc == 0)
+      ftp_send_response(session, 226, "OK\r\n");
+    else
+      ftp_send_response(session, 426, "Connection broken during transfer\r\n");
     return -1;
   }
 
-  session->bufferpos += rc;
+  /* move all of it from the pipe into the file */
+  session->xfer_bytes += rc;
+  size = rc;
+  while(size > 0)
+  {
+    offset = session->filepos;
+    rc = splice(session->pipe_fd[0], NULL, session->file_fd, &offset,
+                size, SPLICE_F_MOVE);
+    ++session->xfer_syscalls;
+    if(rc <= 0)
+    {
+      if(rc < 0 && errno == EINVAL)
+      {
+        /* this file can't be written this way; write it from buffers instead */
+        if(lseek(session->file_fd, session->filepos, SEEK_SET) == session->filepos
+        && ftp_session_drain_pipe(session, size) == 0)
+        {
+          session->transfer = writebehind_transfer;
+          return 0;
+        }
+      }
+      else
+        console_print(RED "splice: %d %s\n" RESET, errno, strerror(errno));
+
+      /* the pipe may still hold data; start over with a new one */
+      close(session->pipe_fd[0]);
+      close(session->pipe_fd[1]);
+      session->pipe_fd[0] = session->pipe_fd[1] = -1;
+
+      ftp_session_close_file(session);
+      ftp_session_set_state(session, COMMAND_STATE);
+      ftp_send_response(session, 451, "Failed to write file\r\n");
+      return -1;
+    }
+
+    size             -= rc;
+    session->filepos += rc;
+  }
+
   return 0;
 }
+#endif
 
+#ifdef FTP_USE_IO_URING
+/*! send file to peer through the worker's io_uring
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 when the callback should not be called again this round
+ *
+ *  @note after this first call, ring completions drive the transfer
+ */
 static int
-retrieve_transfer(ftp_session_t *session)
+uring_retrieve_transfer(ftp_session_t *session)
 {
-  ssize_t rc;
+  if(ftp_session_get_io_buffer(session) != 0)
+  {
+    /* no ring or no free buffer; wait on socket readiness instead */
+#ifdef FTP_USE_SENDFILE
+    session->transfer = sendfile_transfer;
+#else
+    session->transfer = retrieve_transfer;
+#endif
+    return 0;
+  }
 
-  if(session->bufferpos == session->buffersize)
+  ftp_session_start_io(session);
+  return -1;
+}
+
+/*! receive file from peer through the worker's io_uring
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 when the callback should not be called again this round
+ *
+ *  @note after this first call, ring completions drive the transfer
+ */
+static int
+uring_store_transfer(ftp_session_t *session)
+{
+  if(ftp_session_get_io_buffer(session) != 0)
   {
-    rc = ftp_session_read_file(session);
-    if(rc <= 0)
+    /* no ring or no free buffer; wait on socket readiness instead */
+    session->transfer = writebehind_transfer;
+#ifdef FTP_USE_SPLICE
+    if(ftp_session_open_pipe(session) == 0)
+      session->transfer = splice_transfer;
+#endif
+    return 0;
+  }
+
+  ftp_session_start_io(session);
+  return -1;
+}
+#endif
+
+/*! start receiving a file for STOR or APPE
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    path
+ *  @param[in] append  keep the existing file and write after its end
+ *
+ *  @returns bytes sent in the response
+ */
+static int
+store_file(ftp_session_t *session,
+           const char    *args,
+           int           append)
+{
+  int rc;
+  int (*transfer)(ftp_session_t*) = writebehind_transfer;
+
+  if(build_path(session, args) != 0)
+  {
+    rc = errno;
+    ftp_session_set_state(session, COMMAND_STATE);
+    return ftp_send_response(session, 553, "%s\r\n", strerror(rc));
+  }
+
+  if(ftp_session_open_file_write(session, append) != 0)
+  {
+    ftp_session_set_state(session, COMMAND_STATE);
+    return ftp_send_response(session, 450, "failed to open file\r\n");
+  }
+
+  /* listings change now and again once the upload is done */
+  ftp_session_end_store(session);
+  ftp_invalidate_parent(session->buffer);
+  session->store_path = strdup(session->buffer);
+
+#if defined(FTP_USE_IO_URING)
+  /* move the data through io_uring; this falls back to splice() itself */
+  transfer = uring_store_transfer;
+#elif defined(FTP_USE_SPLICE)
+  /* move the data with splice() if we can get a pipe */
+  if(ftp_session_open_pipe(session) == 0)
+    transfer = splice_transfer;
+#endif
+
+  if(session->flags & SESSION_PORT)
+  {
+    ftp_session_set_state(session, DATA_TRANSFER_STATE);
+    rc = ftp_session_connect(session);
+    if(rc != 0)
     {
-      ftp_session_close_file(session);
       ftp_session_set_state(session, COMMAND_STATE);
-      if(rc < 0)
-        ftp_send_response(session, 451, "Failed to read file\r\n");
-      else
-        ftp_send_response(session, 226, "OK\r\n");
-      return -1;
+      return ftp_send_response(session, 425, "can't open data connection\r\n");
     }
 
+    session->flags &= ~(SESSION_RECV|SESSION_SEND);
+    session->flags |= SESSION_RECV;
+
+    session->transfer   = transfer;
     session->bufferpos  = 0;
-    session->buffersize = rc;
-  }
+    session->buffersize = 0;
 
-  rc = send(session->data_fd, session->buffer + session->bufferpos,
-            session->buffersize - session->bufferpos, 0);
-  if(rc <= 0)
+    return ftp_send_response(session, 150, "Ready\r\n");
+  }
+  else if(session->flags & SESSION_PASV)
   {
-    if(rc < 0)
-    {
-      if(errno == EWOULDBLOCK)
-        return -1;
-      console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
-    }
-    else
-      console_print(YELLOW "send: %d %s\n" RESET, ECONNRESET, strerror(ECONNRESET));
+    session->flags &= ~(SESSION_RECV|SESSION_SEND);
+    session->flags |= SESSION_RECV;
 
-    ftp_session_close_file(session);
-    ftp_session_set_state(session, COMMAND_STATE);
-    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
-    return -1;
+    session->transfer   = transfer;
+    session->bufferpos  = 0;
+    session->buffersize = 0;
+
+    ftp_session_set_state(session, DATA_CONNECT_STATE);
+    return 0;
   }
 
-  session->bufferpos += rc;
-  return 0;
+  ftp_session_set_state(session, COMMAND_STATE);
+  return ftp_send_response(session, 503, "Bad sequence of commands\r\n");
 }
 
+/*! start sending a directory listing for LIST, MLSD or NLST
+ *
+ *  @param[in] session ftp session
+ *  @param[in] path    directory to list
+ *  @param[in] format  how to render the listing
+ *
+ *  @returns bytes sent in the response
+ */
 static int
-store_transfer(ftp_session_t *session)
+list_dir(ftp_session_t *session,
+         const char    *path,
+         list_format_t format)
 {
   ssize_t rc;
+  int     (*transfer)(ftp_session_t*) = list_transfer;
 
-  if(session->bufferpos == session->buffersize)
+  /* drop what an earlier listing left waiting for a data connection */
+  if(session->dp != NULL)
+    ftp_session_close_dir(session);
+  ftp_session_put_listing(session);
+
+  session->list_path = strdup(path);
+  if(session->list_path == NULL)
   {
-    rc = recv(session->data_fd, session->buffer, sizeof(session->buffer), 0);
-    if(rc <= 0)
+    ftp_session_set_state(session, COMMAND_STATE);
+    return ftp_send_response(session, 451, "%s\r\n", strerror(ENOMEM));
+  }
+
+  session->list_format = format;
+  session->list_facts  = format == MLSD_FORMAT ? session->mlst_facts : 0;
+
+  /* a recent listing of this directory can be sent straight from memory */
+  session->listing = listcache_get(&list_cache, session->list_path,
+                                   ftp_session_list_key(session), ftp_time());
+  if(session->listing != NULL)
+    transfer = cached_list_transfer;
+  else
+  {
+    if(ftp_session_get_buffer(session) != 0)
     {
-      if(rc < 0)
-      {
-        if(errno == EWOULDBLOCK)
-          return -1;
-        console_print(RED "recv: %d %s\n" RESET, errno, strerror(errno));
-      }
+      ftp_session_set_state(session, COMMAND_STATE);
+      return ftp_send_response(session, 451, "%s\r\n", strerror(ENOMEM));
+    }
 
-      ftp_session_close_file(session);
+    session->list_entries = 0;
+    session->list_stats   = 0;
+    ftp_session_start_capture(session);
+    if(ftp_session_open_dir(session) != 0)
+    {
       ftp_session_set_state(session, COMMAND_STATE);
+      return ftp_send_response(session, 550, "unavailable\r\n");
+    }
 
-      if(rc == 0)
-      {
-        ftp_send_response(session, 226, "OK\r\n");
-      }
-      else
-        ftp_send_response(session, 426, "Connection broken during transfer\r\n");
-      return -1;
+    /* names alone come straight from readdir() */
+    if(format != NLST_FORMAT)
+      ftp_session_get_prefetch(session);
+  }
+  
+  if(session->flags & SESSION_PORT)
+  {
+    ftp_session_set_state(session, DATA_TRANSFER_STATE);
+    rc = ftp_session_connect(session);
+    if(rc != 0)
+    {
+      ftp_session_set_state(session, COMMAND_STATE);
+      return ftp_send_response(session, 425, "can't open data connection\r\n");
     }
 
+    session->flags &= ~(SESSION_RECV|SESSION_SEND);
+    session->flags |= SESSION_SEND;
+
+    session->transfer   = transfer;
     session->bufferpos  = 0;
-    session->buffersize = rc;
-  }
+    session->buffersize = 0;
 
-  rc = ftp_session_write_file(session);
-  if(rc <= 0)
+    return ftp_send_response(session, 150, "Ready\r\n");
+  }
+  else if(session->flags & SESSION_PASV)
   {
-    ftp_session_close_file(session);
-    ftp_session_set_state(session, COMMAND_STATE);
-    ftp_send_response(session, 451, "Failed to write file\r\n");
-    return -1;
+    session->flags &= ~(SESSION_RECV|SESSION_SEND);
+    session->flags |= SESSION_SEND;
+
+    session->transfer   = transfer;
+    session->bufferpos  = 0;
+    session->buffersize = 0;
+
+    ftp_session_set_state(session, DATA_CONNECT_STATE);
+    return 0;
   }
 
-  session->bufferpos += rc;
-  return 0;
+  ftp_session_set_state(session, COMMAND_STATE);
+  return ftp_send_response(session, 503, "Bad sequence of commands\r\n");
 }
 
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
  *                                                                           *
  *                          F T P   C O M M A N D S                          *
@@ -1504,12 +6127,9 @@ FTP_DECLARE(ALLO)
 
 FTP_DECLARE(APPE)
 {
-  /* TODO */
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  ftp_session_set_state(session, COMMAND_STATE);
-
-  return ftp_send_response(session, 502, "unavailable\r\n");
+  return store_file(session, args, 1);
 }
 
 FTP_DECLARE(CDUP)
@@ -1576,69 +6196,79 @@ FTP_DECLARE(DELE)
     return ftp_send_response(session, 550, "failed to delete file\r\n");
   }
 
+  ftp_invalidate_parent(session->buffer);
+
   return ftp_send_response(session, 250, "OK\r\n");
 }
 
 FTP_DECLARE(FEAT)
 {
+  char   facts[64];
+  size_t i, len = 0;
+
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
   ftp_session_set_state(session, COMMAND_STATE);
 
-  return ftp_send_response(session, 211, "\r\n UTF8\r\n211 End\r\n");
+  /* the facts MLSD and MLST send right now are starred */
+  for(i = 0; i < sizeof(ftp_facts)/sizeof(ftp_facts[0]); ++i)
+    len += sprintf(facts + len, "%s%s;", ftp_facts[i],
+                   (session->mlst_facts & (1 << i)) ? "*" : "");
+
+  return ftp_send_response(session, 211, "\r\n MLST %s\r\n UTF8\r\n REST STREAM\r\n211 End\r\n",
+                           facts);
 }
 
 FTP_DECLARE(LIST)
 {
-  ssize_t rc;
+  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  /* options like -la are ignored; this always lists the cwd */
+  return list_dir(session, session->cwd, LIST_FORMAT);
+}
+
+FTP_DECLARE(MKD)
+{
+  int rc;
 
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  if(ftp_session_open_cwd(session) != 0)
+  ftp_session_set_state(session, COMMAND_STATE);
+
+  if(build_path(session, args) != 0)
+    return ftp_send_response(session, 553, "%s\r\n", strerror(errno));
+
+  rc = mkdir(session->buffer, 0755);
+  if(rc != 0)
   {
-    ftp_session_set_state(session, COMMAND_STATE);
-    return ftp_send_response(session, 550, "unavailable\r\n");
+    console_print(RED "mkdir: %d %s\n" RESET, errno, strerror(errno));
+    return ftp_send_response(session, 550, "failed to create directory\r\n");
   }
-  
-  if(session->flags & SESSION_PORT)
-  {
-    ftp_session_set_state(session, DATA_TRANSFER_STATE);
-    rc = ftp_session_connect(session);
-    if(rc != 0)
-    {
-      ftp_session_set_state(session, COMMAND_STATE);
-      return ftp_send_response(session, 425, "can't open data connection\r\n");
-    }
-
-    session->flags &= ~(SESSION_RECV|SESSION_SEND);
-    session->flags |= SESSION_SEND;
 
-    session->transfer   = list_transfer;
-    session->bufferpos  = 0;
-    session->buffersize = 0;
+  ftp_invalidate_parent(session->buffer);
 
-    return ftp_send_response(session, 150, "Ready\r\n");
-  }
-  else if(session->flags & SESSION_PASV)
-  {
-    session->flags &= ~(SESSION_RECV|SESSION_SEND);
-    session->flags |= SESSION_SEND;
+  return ftp_send_response(session, 250, "OK\r\n");
+}
 
-    session->transfer   = list_transfer;
-    session->bufferpos  = 0;
-    session->buffersize = 0;
+FTP_DECLARE(MLSD)
+{
+  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-    ftp_session_set_state(session, DATA_CONNECT_STATE);
-    return 0;
+  if(build_path(session, args) != 0)
+  {
+    int rc = errno;
+    ftp_session_set_state(session, COMMAND_STATE);
+    return ftp_send_response(session, 553, "%s\r\n", strerror(rc));
   }
 
-  ftp_session_set_state(session, COMMAND_STATE);
-  return ftp_send_response(session, 503, "Bad sequence of commands\r\n");
+  return list_dir(session, session->buffer, MLSD_FORMAT);
 }
 
-FTP_DECLARE(MKD)
+FTP_DECLARE(MLST)
 {
-  int rc;
+  int         rc;
+  struct stat st;
+  char        facts[FACTS_MAX];
 
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
@@ -1647,14 +6277,16 @@ FTP_DECLARE(MKD)
   if(build_path(session, args) != 0)
     return ftp_send_response(session, 553, "%s\r\n", strerror(errno));
 
-  rc = mkdir(session->buffer, 0755);
+  rc = lstat(session->buffer, &st);
   if(rc != 0)
   {
-    console_print(RED "mkdir: %d %s\n" RESET, errno, strerror(errno));
-    return ftp_send_response(session, 550, "failed to create directory\r\n");
+    console_print(RED "lstat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    return ftp_send_response(session, 550, "unavailable\r\n");
   }
 
-  return ftp_send_response(session, 250, "OK\r\n");
+  ftp_format_facts(facts, &st, session->mlst_facts);
+  return ftp_send_response(session, 250, "-Status\r\n %s %s\r\n250 End\r\n",
+                           facts, session->buffer);
 }
 
 FTP_DECLARE(MODE)
@@ -1671,12 +6303,20 @@ FTP_DECLARE(MODE)
 
 FTP_DECLARE(NLST)
 {
-  /* TODO */
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  ftp_session_set_state(session, COMMAND_STATE);
+  /* like LIST, options such as -a are ignored */
+  if(args[0] == 0 || args[0] == '-')
+    return list_dir(session, session->cwd, NLST_FORMAT);
 
-  return ftp_send_response(session, 504, "unavailable\r\n");
+  if(build_path(session, args) != 0)
+  {
+    int rc = errno;
+    ftp_session_set_state(session, COMMAND_STATE);
+    return ftp_send_response(session, 553, "%s\r\n", strerror(rc));
+  }
+
+  return list_dir(session, session->buffer, NLST_FORMAT);
 }
 
 FTP_DECLARE(NOOP)
@@ -1696,6 +6336,42 @@ FTP_DECLARE(OPTS)
   || strcasecmp(args, "UTF8 NLST") == 0)
     return ftp_send_response(session, 200, "OK\r\n");
 
+  /* select the facts for MLSD and MLST, e.g. "MLST type;size;" */
+  if(strncasecmp(args, "MLST", 4) == 0 && (args[4] == 0 || args[4] == ' '))
+  {
+    char       facts[64];
+    const char *p = args + 4, *end;
+    size_t     i, len;
+
+    session->mlst_facts = 0;
+    while(*p != 0)
+    {
+      while(*p == ' ' || *p == ';')
+        ++p;
+      for(end = p; *end != 0 && *end != ';'; ++end)
+        ;
+
+      /* unknown facts are ignored */
+      for(i = 0; i < sizeof(ftp_facts)/sizeof(ftp_facts[0]); ++i)
+      {
+        if(strlen(ftp_facts[i]) == (size_t)(end - p)
+        && strncasecmp(p, ftp_facts[i], end - p) == 0)
+          session->mlst_facts |= 1 << i;
+      }
+      p = end;
+    }
+
+    len = 0;
+    for(i = 0; i < sizeof(ftp_facts)/sizeof(ftp_facts[0]); ++i)
+    {
+      if(session->mlst_facts & (1 << i))
+        len += sprintf(facts + len, "%s;", ftp_facts[i]);
+    }
+    facts[len] = 0;
+
+    return ftp_send_response(session, 200, "MLST OPTS %s\r\n", facts);
+  }
+
   return ftp_send_response(session, 504, "invalid argument\r\n");
 }
 
@@ -1712,7 +6388,7 @@ FTP_DECLARE(PASV)
 {
   int       rc;
   char      buffer[INET_ADDRSTRLEN + 10];
-  char      *p;
+  uint32_t  addr;
   in_port_t port;
 
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
@@ -1776,15 +6452,13 @@ FTP_DECLARE(PASV)
 
   session->flags |= SESSION_PASV;
 
+  /* inet_ntoa's static buffer is shared by all workers */
+  addr = ntohl(session->pasv_addr.sin_addr.s_addr);
   port = ntohs(session->pasv_addr.sin_port);
-  strcpy(buffer, inet_ntoa(session->pasv_addr.sin_addr));
-  sprintf(buffer+strlen(buffer), ",%u,%u",
+  sprintf(buffer, "%u,%u,%u,%u,%u,%u",
+          (addr >> 24) & 0xFF, (addr >> 16) & 0xFF,
+          (addr >> 8) & 0xFF, addr & 0xFF,
           port >> 8, port & 0xFF);
-  for(p = buffer; *p; ++p)
-  {
-    if(*p == '.')
-      *p = ',';
-  }
 
   return ftp_send_response(session, 227, "%s\r\n", buffer);
 }
@@ -1898,17 +6572,33 @@ FTP_DECLARE(QUIT)
 
 FTP_DECLARE(REST)
 {
-  /* TODO */
+  char               *end;
+  unsigned long long pos;
+
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  ftp_session_set_state(session, COMMAND_STATE);
+  /* stay in the current state; clients send REST after PASV/PORT */
 
-  return ftp_send_response(session, 502, "unavailable\r\n");
+  /* we only do stream mode, so the marker is a byte offset */
+  errno = 0;
+  pos = strtoull(args, &end, 10);
+  if(!isdigit((int)args[0]) || *end != 0 || errno != 0)
+    return ftp_send_response(session, 501, "invalid restart offset\r\n");
+
+  session->restart = pos;
+  return ftp_send_response(session, 350, "Restarting at %llu\r\n", pos);
 }
 
 FTP_DECLARE(RETR)
 {
   int rc;
+#if defined(FTP_USE_IO_URING)
+  int (*transfer)(ftp_session_t*) = uring_retrieve_transfer;
+#elif defined(FTP_USE_SENDFILE)
+  int (*transfer)(ftp_session_t*) = sendfile_transfer;
+#else
+  int (*transfer)(ftp_session_t*) = readahead_transfer;
+#endif
 
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
@@ -1925,6 +6615,13 @@ FTP_DECLARE(RETR)
     return ftp_send_response(session, 450, "failed to open file\r\n");
   }
 
+  if(session->filepos > session->filesize)
+  {
+    ftp_session_close_file(session);
+    ftp_session_set_state(session, COMMAND_STATE);
+    return ftp_send_response(session, 554, "invalid restart offset\r\n");
+  }
+
   if(session->flags & SESSION_PORT)
   {
     ftp_session_set_state(session, DATA_TRANSFER_STATE);
@@ -1938,7 +6635,7 @@ FTP_DECLARE(RETR)
     session->flags &= ~(SESSION_RECV|SESSION_SEND);
     session->flags |= SESSION_SEND;
 
-    session->transfer   = retrieve_transfer;
+    session->transfer   = transfer;
     session->bufferpos  = 0;
     session->buffersize = 0;
 
@@ -1949,7 +6646,7 @@ FTP_DECLARE(RETR)
     session->flags &= ~(SESSION_RECV|SESSION_SEND);
     session->flags |= SESSION_SEND;
 
-    session->transfer   = retrieve_transfer;
+    session->transfer   = transfer;
     session->bufferpos  = 0;
     session->buffersize = 0;
 
@@ -1979,6 +6676,9 @@ FTP_DECLARE(RMD)
     return ftp_send_response(session, 550, "failed to delete directory\r\n");
   }
 
+  ftp_invalidate_parent(session->buffer);
+  ftp_invalidate_tree(session->buffer);
+
   return ftp_send_response(session, 250, "OK\r\n");
 }
 
@@ -2007,7 +6707,8 @@ FTP_DECLARE(RNFR)
 
 FTP_DECLARE(RNTO)
 {
-  int rc;
+  int  rc;
+  char *tmp_buffer;
 
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
@@ -2018,74 +6719,123 @@ FTP_DECLARE(RNTO)
 
   session->flags &= ~SESSION_RENAME;
 
-  memcpy(session->tmp_buffer, session->buffer, XFER_BUFFERSIZE);
+  /* keep the RNFR path and build the new one in a fresh buffer */
+  tmp_buffer      = session->buffer;
+  session->buffer = NULL;
 
   if(build_path(session, args) != 0)
-    return ftp_send_response(session, 554, "%s\r\n", strerror(errno));
+  {
+    rc = errno;
+    ftp_pool_put(&session->worker->xfer_pool, tmp_buffer);
+    return ftp_send_response(session, 554, "%s\r\n", strerror(rc));
+  }
 
-  rc = rename(session->tmp_buffer, session->buffer);
+  rc = rename(tmp_buffer, session->buffer);
   if(rc != 0)
-  {
     console_print(RED "rename: %d %s\n" RESET, errno, strerror(errno));
-    return ftp_send_response(session, 550, "failed to rename file/directory\r\n");
+  else
+  {
+    /* either side may be a directory with cached listings below it */
+    ftp_invalidate_parent(tmp_buffer);
+    ftp_invalidate_tree(tmp_buffer);
+    ftp_invalidate_parent(session->buffer);
+    ftp_invalidate_tree(session->buffer);
   }
+  ftp_pool_put(&session->worker->xfer_pool, tmp_buffer);
+
+  if(rc != 0)
+    return ftp_send_response(session, 550, "failed to rename file/directory\r\n");
 
   return ftp_send_response(session, 250, "OK\r\n");
 }
 
-FTP_DECLARE(STOR)
+/*! send the latency histograms of all workers as a 211 reply
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for error
+ */
+static int
+ftp_session_send_stats(ftp_session_t *session)
 {
-  int rc;
-
-  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
-
-  if(build_path(session, args) != 0)
+  histogram_t  sum;
+  const char   *name;
+  char         line[128];
+  unsigned int i, j, which;
+  int          len;
+
+  ftp_send_response(session, 211, "Latency (usec)\r\n");
+  len = sprintf(line, " %-10s %10s %8s %8s %8s\r\n", "", "count", "p50", "p99", "max");
+  ftp_session_queue_output(session, line, len);
+
+  /* commands by name, then the data connection */
+  for(i = 0; i < sizeof(ftp_command_order) + 2; ++i)
   {
-    rc = errno;
-    ftp_session_set_state(session, COMMAND_STATE);
-    return ftp_send_response(session, 553, "%s\r\n", strerror(rc));
-  }
+    if(i < sizeof(ftp_command_order))
+    {
+      which = ftp_command_order[i];
+      name  = ftp_commands[which].name;
+    }
+    else if(i == sizeof(ftp_command_order))
+    {
+      which = LATENCY_DATA_SETUP;
+      name  = "data-setup";
+    }
+    else
+    {
+      which = LATENCY_FIRST_BYTE;
+      name  = "first-byte";
+    }
 
-  if(ftp_session_open_file_write(session) != 0)
-  {
-    ftp_session_set_state(session, COMMAND_STATE);
-    return ftp_send_response(session, 450, "failed to open file\r\n");
+    /* the workers keep recording while we add them up */
+    memset(&sum, 0, sizeof(sum));
+    for(j = 0; j < num_workers; ++j)
+      histogram_add(&sum, &workers[j].latency[which]);
+    if(histogram_count(&sum) == 0)
+      continue;
+
+    len = sprintf(line, " %-10s %10llu %8llu %8llu %8llu\r\n", name,
+                  (unsigned long long)histogram_count(&sum),
+                  (unsigned long long)histogram_percentile(&sum, 50),
+                  (unsigned long long)histogram_percentile(&sum, 99),
+                  (unsigned long long)sum.max);
+    ftp_session_queue_output(session, line, len);
   }
 
-  if(session->flags & SESSION_PORT)
-  {
-    ftp_session_set_state(session, DATA_TRANSFER_STATE);
-    rc = ftp_session_connect(session);
-    if(rc != 0)
-    {
-      ftp_session_set_state(session, COMMAND_STATE);
-      return ftp_send_response(session, 425, "can't open data connection\r\n");
-    }
+  len = sprintf(line, "211 End\r\n");
+  return ftp_session_queue_output(session, line, len);
+}
 
-    session->flags &= ~(SESSION_RECV|SESSION_SEND);
-    session->flags |= SESSION_RECV;
+FTP_DECLARE(SITE)
+{
+  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-    session->transfer   = store_transfer;
-    session->bufferpos  = 0;
-    session->buffersize = 0;
+  ftp_session_set_state(session, COMMAND_STATE);
 
-    return ftp_send_response(session, 150, "Ready\r\n");
-  }
-  else if(session->flags & SESSION_PASV)
-  {
-    session->flags &= ~(SESSION_RECV|SESSION_SEND);
-    session->flags |= SESSION_RECV;
+  if(strcasecmp(args, "STATS") == 0)
+    return ftp_session_send_stats(session);
 
-    session->transfer   = store_transfer;
-    session->bufferpos  = 0;
-    session->buffersize = 0;
+  return ftp_send_response(session, 504, "invalid argument\r\n");
+}
 
-    ftp_session_set_state(session, DATA_CONNECT_STATE);
-    return 0;
-  }
+FTP_DECLARE(STAT)
+{
+  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
   ftp_session_set_state(session, COMMAND_STATE);
-  return ftp_send_response(session, 503, "Bad sequence of commands\r\n");
+
+  /* only the server status; STAT <path> listings are not supported */
+  if(*args != 0)
+    return ftp_send_response(session, 504, "invalid argument\r\n");
+
+  return ftp_session_send_stats(session);
+}
+
+FTP_DECLARE(STOR)
+{
+  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  return store_file(session, args, 0);
 }
 
 FTP_DECLARE(STOU)
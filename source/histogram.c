@@ -0,0 +1,132 @@
+#include "histogram.h"
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+/*! get the bucket a value is counted in
+ *
+ *  @param[in] value value
+ *
+ *  @returns bucket index
+ */
+static unsigned int
+histogram_bucket(uint64_t value)
+{
+  unsigned int exp;
+
+  if(value < SUB_BUCKETS)
+    return value;
+  if(value > UINT32_MAX)
+    return HISTOGRAM_BUCKETS - 1;
+
+  /* the power of two picks the group, the next bits the bucket in it */
+  exp = 63 - __builtin_clzll(value);
+  return ((exp - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+       | ((value >> (exp - HISTOGRAM_SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/*! get the largest value counted in a bucket
+ *
+ *  @param[in] bucket bucket index
+ *
+ *  @returns largest value
+ */
+static uint64_t
+histogram_bucket_max(unsigned int bucket)
+{
+  unsigned int group = bucket >> HISTOGRAM_SUB_BITS;
+  uint64_t     low;
+
+  if(group == 0)
+    return bucket;
+
+  low = (uint64_t)(SUB_BUCKETS | (bucket & (SUB_BUCKETS - 1))) << (group - 1);
+  return low + (1ULL << (group - 1)) - 1;
+}
+
+/*! record a value
+ *
+ *  @param[in] hist  histogram
+ *  @param[in] value value
+ *
+ *  @note only the thread which owns the histogram may call this
+ */
+void
+histogram_record(histogram_t *hist,
+                 uint64_t    value)
+{
+  unsigned int bucket = histogram_bucket(value);
+
+  /* a single writer; readers only need to see whole values */
+  __atomic_store_n(&hist->count[bucket], hist->count[bucket] + 1, __ATOMIC_RELAXED);
+  if(value > hist->max)
+    __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+}
+
+/*! add the samples of a histogram another thread may be recording into
+ *
+ *  @param[in] sum  histogram to add to
+ *  @param[in] hist histogram to add
+ */
+void
+histogram_add(histogram_t       *sum,
+              const histogram_t *hist)
+{
+  unsigned int i;
+  uint64_t     max;
+
+  for(i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    sum->count[i] += __atomic_load_n(&hist->count[i], __ATOMIC_RELAXED);
+
+  max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+  if(max > sum->max)
+    sum->max = max;
+}
+
+/*! count the samples in a histogram
+ *
+ *  @param[in] hist histogram
+ *
+ *  @returns number of samples
+ */
+uint64_t
+histogram_count(const histogram_t *hist)
+{
+  unsigned int i;
+  uint64_t     count = 0;
+
+  for(i = 0; i < HISTOGRAM_BUCKETS; ++i)
+    count += hist->count[i];
+
+  return count;
+}
+
+/*! get a percentile of the samples in a histogram
+ *
+ *  @param[in] hist    histogram
+ *  @param[in] percent percentile (0-100)
+ *
+ *  @returns largest value of the bucket the percentile falls in, but no more
+ *           than the largest sample
+ *  @returns 0 if the histogram is empty
+ */
+uint64_t
+histogram_percentile(const histogram_t *hist,
+                     unsigned int      percent)
+{
+  unsigned int i;
+  uint64_t     rank, seen = 0;
+
+  /* percent of the samples are at or below the rank-th one */
+  rank = (histogram_count(hist)*percent + 99) / 100;
+  if(rank == 0)
+    rank = 1;
+
+  for(i = 0; i < HISTOGRAM_BUCKETS; ++i)
+  {
+    seen += hist->count[i];
+    if(seen >= rank)
+      return histogram_bucket_max(i) < hist->max ? histogram_bucket_max(i) : hist->max;
+  }
+
+  return 0;
+}
@@ -0,0 +1,309 @@
+#include "listcache.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*! unlink entry from the LRU list
+ *
+ *  @param[in] cache cache
+ *  @param[in] entry entry to unlink
+ */
+static void
+listcache_unlink(listcache_t       *cache,
+                 listcache_entry_t *entry)
+{
+  if(entry->prev != NULL)
+    entry->prev->next = entry->next;
+  else
+    cache->head = entry->next;
+
+  if(entry->next != NULL)
+    entry->next->prev = entry->prev;
+  else
+    cache->tail = entry->prev;
+
+  entry->prev = entry->next = NULL;
+}
+
+/*! link entry at the front of the LRU list
+ *
+ *  @param[in] cache cache
+ *  @param[in] entry entry to link
+ */
+static void
+listcache_link(listcache_t       *cache,
+               listcache_entry_t *entry)
+{
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if(cache->head != NULL)
+    cache->head->prev = entry;
+  else
+    cache->tail = entry;
+  cache->head = entry;
+}
+
+/*! drop a reference to an entry, freeing it after the last one
+ *
+ *  @param[in] entry entry to release
+ *
+ *  @note the cache lock must be held
+ */
+static void
+listcache_release(listcache_entry_t *entry)
+{
+  if(--entry->refs == 0)
+  {
+    free(entry->data);
+    free(entry);
+  }
+}
+
+/*! remove entry from the cache; sessions still sending it keep it alive
+ *
+ *  @param[in] cache cache
+ *  @param[in] entry entry to remove
+ *
+ *  @note the cache lock must be held
+ */
+static void
+listcache_remove(listcache_t       *cache,
+                 listcache_entry_t *entry)
+{
+  listcache_unlink(cache, entry);
+  cache->size -= entry->cost;
+  listcache_release(entry);
+}
+
+/*! initialize listing cache
+ *
+ *  @param[out] cache    cache to initialize
+ *  @param[in]  capacity most bytes to keep (0 to disable)
+ *  @param[in]  ttl      how long a listing stays fresh (usec, 0 for forever)
+ *
+ *  @returns -1 for error
+ */
+int
+listcache_init(listcache_t *cache,
+               size_t      capacity,
+               uint64_t    ttl)
+{
+  memset(cache, 0, sizeof(*cache));
+  cache->capacity = capacity;
+  cache->ttl      = ttl;
+
+  if(mutex_init(&cache->lock) != 0)
+    return -1;
+
+  cache->initialized = 1;
+  return 0;
+}
+
+/*! deinitialize listing cache
+ *
+ *  @param[in] cache cache to deinitialize
+ *
+ *  @note every entry returned by listcache_get must have been put back
+ */
+void
+listcache_exit(listcache_t *cache)
+{
+  if(!cache->initialized)
+    return;
+
+  while(cache->head != NULL)
+    listcache_remove(cache, cache->head);
+
+  mutex_destroy(&cache->lock);
+  cache->initialized = 0;
+}
+
+/*! look up the listing of a directory
+ *
+ *  @param[in] cache  cache
+ *  @param[in] path   directory
+ *  @param[in] format how the listing is rendered
+ *  @param[in] now    current time (usec)
+ *
+ *  @returns referenced entry to give back with listcache_put
+ *  @returns NULL if the listing is not cached or has gone stale
+ */
+listcache_entry_t*
+listcache_get(listcache_t  *cache,
+              const char   *path,
+              unsigned int format,
+              uint64_t     now)
+{
+  listcache_entry_t *entry;
+
+  if(cache->capacity == 0)
+    return NULL;
+
+  mutex_lock(&cache->lock);
+  for(entry = cache->head; entry != NULL; entry = entry->next)
+  {
+    if(entry->format == format && strcmp(entry->path, path) == 0)
+      break;
+  }
+
+  if(entry != NULL && entry->expires != 0 && now >= entry->expires)
+  {
+    /* something other than this server may have changed it */
+    listcache_remove(cache, entry);
+    entry = NULL;
+  }
+
+  if(entry != NULL)
+  {
+    /* most recently used goes to the front */
+    listcache_unlink(cache, entry);
+    listcache_link(cache, entry);
+    ++entry->refs;
+  }
+  mutex_unlock(&cache->lock);
+
+  return entry;
+}
+
+/*! give back an entry returned by listcache_get
+ *
+ *  @param[in] cache cache
+ *  @param[in] entry entry
+ */
+void
+listcache_put(listcache_t       *cache,
+              listcache_entry_t *entry)
+{
+  mutex_lock(&cache->lock);
+  listcache_release(entry);
+  mutex_unlock(&cache->lock);
+}
+
+/*! get the invalidation generation
+ *
+ *  @param[in] cache cache
+ *
+ *  @returns value to pass to listcache_insert for a listing read after this call
+ */
+unsigned int
+listcache_generation(listcache_t *cache)
+{
+  return __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE);
+}
+
+/*! add a listing to the cache, evicting the least recently used ones to make room
+ *
+ *  @param[in] cache      cache
+ *  @param[in] path       directory that was listed
+ *  @param[in] format     how the listing was rendered
+ *  @param[in] data       rendered listing from malloc(); the cache takes ownership
+ *  @param[in] size       bytes in data
+ *  @param[in] entries    directory entries in the listing
+ *  @param[in] generation listcache_generation() from before the directory was read
+ *  @param[in] now        current time (usec)
+ *
+ *  @note the listing is dropped if anything was invalidated since generation,
+ *        since the directory may have changed while it was being read
+ */
+void
+listcache_insert(listcache_t  *cache,
+                 const char   *path,
+                 unsigned int format,
+                 char         *data,
+                 size_t       size,
+                 uint64_t     entries,
+                 unsigned int generation,
+                 uint64_t     now)
+{
+  listcache_entry_t *entry, *old;
+  size_t            len  = strlen(path);
+  size_t            cost = sizeof(*entry) + len + 1 + size;
+
+  if(cost > cache->capacity)
+  {
+    free(data);
+    return;
+  }
+
+  /* the path is stored right after the entry */
+  entry = (listcache_entry_t*)malloc(sizeof(*entry) + len + 1);
+  if(entry == NULL)
+  {
+    free(data);
+    return;
+  }
+
+  memcpy(entry + 1, path, len + 1);
+  entry->path    = (const char*)(entry + 1);
+  entry->format  = format;
+  entry->data    = data;
+  entry->size    = size;
+  entry->entries = entries;
+  entry->cost    = cost;
+  entry->expires = cache->ttl ? now + cache->ttl : 0;
+  entry->refs    = 1;
+
+  mutex_lock(&cache->lock);
+  if(generation != cache->generation)
+  {
+    mutex_unlock(&cache->lock);
+    free(data);
+    free(entry);
+    return;
+  }
+
+  /* replace a listing another session cached in the meantime */
+  for(old = cache->head; old != NULL; old = old->next)
+  {
+    if(old->format == format && strcmp(old->path, path) == 0)
+    {
+      listcache_remove(cache, old);
+      break;
+    }
+  }
+
+  while(cache->size + cost > cache->capacity)
+    listcache_remove(cache, cache->tail);
+
+  listcache_link(cache, entry);
+  cache->size += cost;
+  mutex_unlock(&cache->lock);
+}
+
+/*! drop cached listings after a change to the file system
+ *
+ *  @param[in] cache   cache
+ *  @param[in] path    directory whose contents changed
+ *  @param[in] len     length of path
+ *  @param[in] subtree also drop listings of every directory below path
+ */
+void
+listcache_invalidate(listcache_t *cache,
+                     const char  *path,
+                     size_t      len,
+                     int         subtree)
+{
+  listcache_entry_t *entry, *next;
+
+  if(cache->capacity == 0)
+    return;
+
+  mutex_lock(&cache->lock);
+
+  /* listings being read right now may already be out of date */
+  __atomic_store_n(&cache->generation, cache->generation + 1, __ATOMIC_RELEASE);
+
+  for(entry = cache->head; entry != NULL; entry = next)
+  {
+    next = entry->next;
+
+    if(strncmp(entry->path, path, len) != 0)
+      continue;
+
+    /* "/" is the only path that ends with a slash */
+    if(entry->path[len] == 0
+    || (subtree && (entry->path[len] == '/' || path[len-1] == '/')))
+      listcache_remove(cache, entry);
+  }
+
+  mutex_unlock(&cache->lock);
+}
@@ -1,26 +1,47 @@
 #include <malloc.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #ifdef _3DS
 #include <3ds.h>
+#else
+#include <unistd.h>
 #endif
 #include "console.h"
 #include "ftp.h"
 
+#ifdef _3DS
+#ifndef SYSCLOCK_ARM11
+#define SYSCLOCK_ARM11 268111856ULL
+#endif
+/*! system ticks per rendered frame (60 Hz) */
+#define FRAME_TICKS (SYSCLOCK_ARM11 / 60)
+#endif
+
 /*! looping mechanism
  *
  *  @param[in] callback function to call during each iteration
+ *
+ *  @note the screen is redrawn at most once per frame, so the callback can
+ *        run many times between redraws
  */
 static void
 loop(int (*callback)(void))
 {
 #ifdef _3DS
+  u64 now, next_frame = svcGetSystemTick();
+
   while(aptMainLoop())
   {
-    if(callback() == 0)
-      console_render();
-    else
+    if(callback() != 0)
       return;
+
+    now = svcGetSystemTick();
+    if(now >= next_frame)
+    {
+      console_render();
+      next_frame = now + FRAME_TICKS;
+    }
   }
 #else
   for(;;)
@@ -36,6 +57,9 @@ static int
 wait_for_b(void)
 {
 #ifdef _3DS
+  /* nothing else to do; only check once per frame */
+  gspWaitForVBlank();
+
   /* update button state */
   hidScanInput();
 
@@ -50,10 +74,87 @@ wait_for_b(void)
 #endif
 }
 
+#ifndef _3DS
+/*! parse command line options into ftp_config
+ *
+ *  @param[in] argc argument count
+ *  @param[in] argv argument vector
+ *
+ *  @returns -1 for invalid options
+ */
+static int
+parse_options(int  argc,
+              char *argv[])
+{
+  int  opt;
+  long val;
+  char *end;
+
+  while((opt = getopt(argc, argv, "c:m:p:q:t:w:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'c':
+        /* bytes of directory listings to cache */
+        val = strtol(optarg, &end, 10);
+        if(*optarg == 0 || *end != 0 || val < 0)
+          return -1;
+        ftp_config.list_cache = val;
+        break;
+
+      case 'm':
+        /* port to serve metrics on */
+        val = strtol(optarg, &end, 10);
+        if(*optarg == 0 || *end != 0 || val < 0 || val > 65535)
+          return -1;
+        ftp_config.metrics_port = val;
+        break;
+
+      case 'p':
+        /* stat threads per worker */
+        val = strtol(optarg, &end, 10);
+        if(*optarg == 0 || *end != 0 || val < 0)
+          return -1;
+        ftp_config.stat_threads = val;
+        break;
+
+      case 'q':
+        /* bytes per transfer per loop round */
+        val = strtol(optarg, &end, 10);
+        if(*optarg == 0 || *end != 0 || val < 0)
+          return -1;
+        ftp_config.quantum = val;
+        break;
+
+      case 't':
+        /* seconds a cached listing stays fresh */
+        val = strtol(optarg, &end, 10);
+        if(*optarg == 0 || *end != 0 || val < 0)
+          return -1;
+        ftp_config.list_ttl = val;
+        break;
+
+      case 'w':
+        /* number of session worker threads */
+        val = strtol(optarg, &end, 10);
+        if(*optarg == 0 || *end != 0 || val < 0)
+          return -1;
+        ftp_config.workers = val;
+        break;
+
+      default:
+        return -1;
+    }
+  }
+
+  return 0;
+}
+#endif
+
 /*! entry point
  *
- *  @param[in] argc unused
- *  @param[in] argv unused
+ *  @param[in] argc argument count
+ *  @param[in] argv argument vector
  *
  *  returns exit status
  */
@@ -66,6 +167,12 @@ main(int  argc,
   gfxInitDefault();
   gfxSet3D(false);
   sdmcWriteSafe(false);
+#else
+  if(parse_options(argc, argv) != 0)
+  {
+    fprintf(stderr, "usage: %s [-c list_cache] [-m metrics_port] [-p stat_threads] [-q quantum] [-t list_ttl] [-w workers]\n", argv[0]);
+    return 1;
+  }
 #endif
 
   /* initialize console subsystem */
@@ -0,0 +1,302 @@
+#include "thread.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "console.h"
+
+#ifdef _3DS
+/*! thread stack size */
+#define STACK_SIZE 0x8000
+
+/*! initialize mutex
+ *
+ *  @param[out] mutex mutex to initialize
+ *
+ *  @returns -1 for error
+ */
+int
+mutex_init(mutex_t *mutex)
+{
+  Result ret;
+
+  ret = svcCreateMutex(mutex, false);
+  if(ret != 0)
+  {
+    console_print(RED "svcCreateMutex: 0x%08X\n" RESET, (unsigned int)ret);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*! deinitialize mutex
+ *
+ *  @param[in] mutex mutex to deinitialize
+ */
+void
+mutex_destroy(mutex_t *mutex)
+{
+  svcCloseHandle(*mutex);
+}
+
+/*! lock mutex
+ *
+ *  @param[in] mutex mutex to lock
+ */
+void
+mutex_lock(mutex_t *mutex)
+{
+  svcWaitSynchronization(*mutex, U64_MAX);
+}
+
+/*! unlock mutex
+ *
+ *  @param[in] mutex mutex to unlock
+ */
+void
+mutex_unlock(mutex_t *mutex)
+{
+  svcReleaseMutex(*mutex);
+}
+
+/*! initialize auto-reset event
+ *
+ *  @param[out] event event to initialize
+ *
+ *  @returns -1 for error
+ */
+int
+event_init(event_t *event)
+{
+  Result ret;
+
+  ret = svcCreateEvent(event, RESET_ONESHOT);
+  if(ret != 0)
+  {
+    console_print(RED "svcCreateEvent: 0x%08X\n" RESET, (unsigned int)ret);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*! deinitialize event
+ *
+ *  @param[in] event event to deinitialize
+ */
+void
+event_destroy(event_t *event)
+{
+  svcCloseHandle(*event);
+}
+
+/*! set event, waking one waiter
+ *
+ *  @param[in] event event to set
+ */
+void
+event_signal(event_t *event)
+{
+  svcSignalEvent(*event);
+}
+
+/*! wait for event to be set, then clear it
+ *
+ *  @param[in] event event to wait for
+ */
+void
+event_wait(event_t *event)
+{
+  svcWaitSynchronization(*event, U64_MAX);
+}
+
+/*! start a thread
+ *
+ *  @param[out] thread thread handle
+ *  @param[in]  entry  thread entry point
+ *  @param[in]  arg    argument for entry point
+ *  @param[in]  core   processor to run on (-1 for any)
+ *
+ *  @returns -1 for error
+ */
+int
+thread_create(thread_t *thread,
+              void     (*entry)(void*),
+              void     *arg,
+              int      core)
+{
+  s32 prio = 0x30;
+
+  /* run at the same priority as the main thread */
+  svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+
+  *thread = threadCreate(entry, arg, STACK_SIZE, prio,
+                         core < 0 ? -2 : core, false);
+  if(*thread == NULL)
+  {
+    console_print(RED "threadCreate: failed\n" RESET);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*! wait for a thread to exit
+ *
+ *  @param[in] thread thread to wait for
+ */
+void
+thread_join(thread_t thread)
+{
+  threadJoin(thread, U64_MAX);
+  threadFree(thread);
+}
+#else
+/*! thread entry point and argument */
+typedef struct
+{
+  void (*entry)(void*); /*!< entry point */
+  void *arg;            /*!< argument for entry point */
+} thread_start_t;
+
+/*! pthread entry point
+ *
+ *  @param[in] arg thread_start_t*
+ *
+ *  @returns NULL
+ */
+static void*
+thread_start(void *arg)
+{
+  thread_start_t start = *(thread_start_t*)arg;
+
+  free(arg);
+  start.entry(start.arg);
+
+  return NULL;
+}
+
+int
+mutex_init(mutex_t *mutex)
+{
+  int rc;
+
+  rc = pthread_mutex_init(mutex, NULL);
+  if(rc != 0)
+  {
+    console_print(RED "pthread_mutex_init: %d %s\n" RESET, rc, strerror(rc));
+    return -1;
+  }
+
+  return 0;
+}
+
+void
+mutex_destroy(mutex_t *mutex)
+{
+  pthread_mutex_destroy(mutex);
+}
+
+void
+mutex_lock(mutex_t *mutex)
+{
+  pthread_mutex_lock(mutex);
+}
+
+void
+mutex_unlock(mutex_t *mutex)
+{
+  pthread_mutex_unlock(mutex);
+}
+
+int
+event_init(event_t *event)
+{
+  int rc;
+
+  rc = pthread_mutex_init(&event->mutex, NULL);
+  if(rc != 0)
+  {
+    console_print(RED "pthread_mutex_init: %d %s\n" RESET, rc, strerror(rc));
+    return -1;
+  }
+
+  rc = pthread_cond_init(&event->cond, NULL);
+  if(rc != 0)
+  {
+    console_print(RED "pthread_cond_init: %d %s\n" RESET, rc, strerror(rc));
+    pthread_mutex_destroy(&event->mutex);
+    return -1;
+  }
+
+  event->signalled = 0;
+  return 0;
+}
+
+void
+event_destroy(event_t *event)
+{
+  pthread_cond_destroy(&event->cond);
+  pthread_mutex_destroy(&event->mutex);
+}
+
+void
+event_signal(event_t *event)
+{
+  pthread_mutex_lock(&event->mutex);
+  event->signalled = 1;
+  pthread_cond_signal(&event->cond);
+  pthread_mutex_unlock(&event->mutex);
+}
+
+void
+event_wait(event_t *event)
+{
+  pthread_mutex_lock(&event->mutex);
+  while(!event->signalled)
+    pthread_cond_wait(&event->cond, &event->mutex);
+  event->signalled = 0;
+  pthread_mutex_unlock(&event->mutex);
+}
+
+int
+thread_create(thread_t *thread,
+              void     (*entry)(void*),
+              void     *arg,
+              int      core)
+{
+  int            rc;
+  thread_start_t *start;
+
+  start = (thread_start_t*)malloc(sizeof(thread_start_t));
+  if(start == NULL)
+  {
+    console_print(RED "thread_create: %d %s\n" RESET, ENOMEM, strerror(ENOMEM));
+    return -1;
+  }
+
+  start->entry = entry;
+  start->arg   = arg;
+
+  /* the scheduler picks the core */
+  rc = pthread_create(thread, NULL, thread_start, start);
+  if(rc != 0)
+  {
+    console_print(RED "pthread_create: %d %s\n" RESET, rc, strerror(rc));
+    free(start);
+    return -1;
+  }
+
+  return 0;
+}
+
+void
+thread_join(thread_t thread)
+{
+  int rc;
+
+  rc = pthread_join(thread, NULL);
+  if(rc != 0)
+    console_print(RED "pthread_join: %d %s\n" RESET, rc, strerror(rc));
+}
+#endif
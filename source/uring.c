@@ -0,0 +1,243 @@
+#include "uring.h"
+#ifdef FTP_USE_IO_URING
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "console.h"
+
+/*! set up io_uring; there is no libc wrapper */
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+/*! submit and wait on io_uring; there is no libc wrapper */
+static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                   unsigned int flags)
+{
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/*! register resources with io_uring; there is no libc wrapper */
+static int
+sys_io_uring_register(int fd, unsigned int opcode, const void *arg,
+                      unsigned int nr_args)
+{
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*! initialize io_uring
+ *
+ *  @param[out] ring    ring to initialize
+ *  @param[in]  entries submission queue capacity
+ *
+ *  @returns -1 for error
+ */
+int
+uring_init(uring_t      *ring,
+           unsigned int entries)
+{
+  struct io_uring_params p;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&p, 0, sizeof(p));
+
+  ring->fd = sys_io_uring_setup(entries, &p);
+  if(ring->fd < 0)
+  {
+    console_print(RED "io_uring_setup: %d %s\n" RESET, errno, strerror(errno));
+    ring->fd = -1;
+    return -1;
+  }
+
+  /* map the submission queue, completion queue and submission entries */
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned int);
+  ring->cq_ring_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  ring->sqes_size    = p.sq_entries*sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes    = mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if(ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+  {
+    console_print(RED "mmap: %d %s\n" RESET, errno, strerror(errno));
+    uring_exit(ring);
+    return -1;
+  }
+
+  ring->sq_head    = (unsigned int*)((char*)ring->sq_ring + p.sq_off.head);
+  ring->sq_tail    = (unsigned int*)((char*)ring->sq_ring + p.sq_off.tail);
+  ring->sq_mask    = (unsigned int*)((char*)ring->sq_ring + p.sq_off.ring_mask);
+  ring->sq_array   = (unsigned int*)((char*)ring->sq_ring + p.sq_off.array);
+  ring->cq_head    = (unsigned int*)((char*)ring->cq_ring + p.cq_off.head);
+  ring->cq_tail    = (unsigned int*)((char*)ring->cq_ring + p.cq_off.tail);
+  ring->cq_mask    = (unsigned int*)((char*)ring->cq_ring + p.cq_off.ring_mask);
+  ring->cqes       = (struct io_uring_cqe*)((char*)ring->cq_ring + p.cq_off.cqes);
+  ring->sq_entries = p.sq_entries;
+  ring->sqe_tail   = *ring->sq_tail;
+
+  return 0;
+}
+
+/*! deinitialize io_uring
+ *
+ *  @param[in] ring ring to deinitialize
+ *
+ *  @note requests still in flight are cancelled by the kernel
+ */
+void
+uring_exit(uring_t *ring)
+{
+  if(ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if(ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if(ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+
+  if(ring->fd >= 0 && close(ring->fd) != 0)
+    console_print(RED "close: %d %s\n" RESET, errno, strerror(errno));
+
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+/*! register fixed buffers with io_uring
+ *
+ *  @param[in] ring  ring
+ *  @param[in] iov   buffers
+ *  @param[in] count number of buffers
+ *
+ *  @returns -1 for error
+ */
+int
+uring_register_buffers(uring_t            *ring,
+                       const struct iovec *iov,
+                       unsigned int       count)
+{
+  if(sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, count) != 0)
+  {
+    console_print(RED "IORING_REGISTER_BUFFERS: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/*! register an eventfd to be signalled on completions
+ *
+ *  @param[in] ring ring
+ *  @param[in] fd   eventfd
+ *
+ *  @returns -1 for error
+ */
+int
+uring_register_eventfd(uring_t *ring,
+                       int     fd)
+{
+  if(sys_io_uring_register(ring->fd, IORING_REGISTER_EVENTFD, &fd, 1) != 0)
+  {
+    console_print(RED "IORING_REGISTER_EVENTFD: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/*! get a free submission queue entry
+ *
+ *  @param[in] ring ring
+ *
+ *  @returns cleared entry
+ *  @returns NULL if the submission queue is full
+ */
+struct io_uring_sqe*
+uring_get_sqe(uring_t *ring)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned int        index;
+
+  if(ring->sqe_tail - head >= ring->sq_entries)
+    return NULL;
+
+  index = ring->sqe_tail & *ring->sq_mask;
+  sqe   = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+
+  ring->sq_array[index] = index;
+  ++ring->sqe_tail;
+  ++ring->to_submit;
+
+  return sqe;
+}
+
+/*! submit filled entries and optionally wait for completions
+ *
+ *  @param[in] ring ring
+ *  @param[in] wait number of completions to wait for
+ *
+ *  @returns number of entries submitted
+ *  @returns -1 for error
+ */
+int
+uring_submit(uring_t      *ring,
+             unsigned int wait)
+{
+  int rc;
+
+  if(ring->to_submit == 0 && wait == 0)
+    return 0;
+
+  /* publish the entries to the kernel */
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+  rc = sys_io_uring_enter(ring->fd, ring->to_submit, wait,
+                          wait ? IORING_ENTER_GETEVENTS : 0);
+  if(rc < 0)
+  {
+    if(errno == EINTR)
+      return 0;
+    console_print(RED "io_uring_enter: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  ring->to_submit -= rc;
+  return rc;
+}
+
+/*! get the next completion
+ *
+ *  @param[in] ring ring
+ *
+ *  @returns completion queue entry
+ *  @returns NULL if there are no completions
+ */
+struct io_uring_cqe*
+uring_peek_cqe(uring_t *ring)
+{
+  unsigned int head = *ring->cq_head;
+
+  if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+/*! consume the completion returned by uring_peek_cqe
+ *
+ *  @param[in] ring ring
+ */
+void
+uring_cqe_seen(uring_t *ring)
+{
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+#endif